@@ -0,0 +1,86 @@
+/*
+ * PROJECT:     ReactOS FC Command
+ * LICENSE:     GPL-2.0-or-later (https://spdx.org/licenses/GPL-2.0-or-later)
+ * PURPOSE:     Bump allocator released in one shot
+ * COPYRIGHT:   Copyright 2021 Katayama Hirofumi MZ (katayama.hirofumi.mz@gmail.com)
+ */
+#include "fc.h"
+
+#define ARENA_BLOCK_SIZE (1024 * 1024) // 1 MB
+#define ARENA_ALIGN 8
+
+typedef struct ARENA_BLOCK
+{
+    struct ARENA_BLOCK *next;
+    SIZE_T cbUsed, cbSize;
+    // the data follows
+} ARENA_BLOCK;
+
+typedef struct ARENA_VIEW
+{
+    struct ARENA_VIEW *next;
+    LPVOID pView;
+} ARENA_VIEW;
+
+#define BLOCK_HEADER_SIZE \
+    ((sizeof(ARENA_BLOCK) + ARENA_ALIGN - 1) & ~(SIZE_T)(ARENA_ALIGN - 1))
+
+LPVOID ArenaAlloc(ARENA *arena, SIZE_T cb)
+{
+    ARENA_BLOCK *block = arena->blocks;
+    LPBYTE pb;
+
+    cb = (cb + ARENA_ALIGN - 1) & ~(SIZE_T)(ARENA_ALIGN - 1);
+    if (!block || block->cbUsed + cb > block->cbSize)
+    {
+        block = malloc(BLOCK_HEADER_SIZE + max(cb, ARENA_BLOCK_SIZE));
+        if (!block)
+            return NULL;
+        STATS_ADD(cAllocs, 1);
+        block->cbUsed = 0;
+        block->cbSize = max(cb, ARENA_BLOCK_SIZE);
+        if (cb > ARENA_BLOCK_SIZE / 2 && arena->blocks)
+        {
+            // a big one doesn't waste the rest of the current block
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        }
+        else
+        {
+            block->next = arena->blocks;
+            arena->blocks = block;
+        }
+    }
+
+    pb = (LPBYTE)block + BLOCK_HEADER_SIZE + block->cbUsed;
+    block->cbUsed += cb;
+    return pb;
+}
+
+// The view is unmapped by ArenaFree
+BOOL ArenaAddView(ARENA *arena, LPVOID pView)
+{
+    ARENA_VIEW *view = ArenaAlloc(arena, sizeof(ARENA_VIEW));
+    if (!view)
+        return FALSE;
+    view->pView = pView;
+    view->next = arena->views;
+    arena->views = view;
+    return TRUE;
+}
+
+VOID ArenaFree(ARENA *arena)
+{
+    ARENA_BLOCK *block, *next;
+    ARENA_VIEW *view;
+
+    for (view = arena->views; view; view = view->next)
+        UnmapViewOfFile(view->pView);
+
+    for (block = arena->blocks; block; block = next)
+    {
+        next = block->next;
+        free(block);
+    }
+    ZeroMemory(arena, sizeof(*arena));
+}
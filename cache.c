@@ -0,0 +1,229 @@
+/*
+ * PROJECT:     ReactOS FC Command
+ * LICENSE:     GPL-2.0-or-later (https://spdx.org/licenses/GPL-2.0-or-later)
+ * PURPOSE:     Persistent cache of file digests
+ * COPYRIGHT:   Copyright 2021 Katayama Hirofumi MZ (katayama.hirofumi.mz@gmail.com)
+ */
+#include "fc.h"
+#include <strsafe.h>
+
+// The cache file is a CACHE_HEADER followed by fixed-size CACHE_ENTRY records
+// sorted by key, so it is loaded by one read (or can be mapped) and searched
+// in place by bisection.
+
+#define CACHE_MAGIC 0x31434346 // "FCC1"
+
+typedef struct CACHE_HEADER
+{
+    DWORD dwMagic;
+    DWORD cbEntry; // sizeof(CACHE_ENTRY)
+    DWORD cEntries;
+    DWORD dwReserved;
+} CACHE_HEADER;
+
+// Hash of the full path in upper case. Never zero.
+static ULONGLONG CacheKey(LPCWSTR file)
+{
+    WCHAR szPath[MAX_PATH];
+    LPCWSTR pch;
+    ULONGLONG key = 14695981039346656037ULL; // FNV-1a
+
+    if (!GetFullPathNameW(file, _countof(szPath), szPath, NULL))
+        StringCbCopyW(szPath, sizeof(szPath), file);
+    for (pch = szPath; *pch; ++pch)
+    {
+        key ^= towupper(*pch);
+        key *= 1099511628211ULL;
+    }
+    return key ? key : 1;
+}
+
+VOID CacheLoad(CACHE *cache, LPCWSTR file)
+{
+    HANDLE hFile;
+    LARGE_INTEGER cb;
+    CACHE_HEADER *header = NULL;
+    DWORD cbRead;
+
+    ZeroMemory(cache, sizeof(*cache));
+    cache->file = file;
+    InitializeCriticalSection(&cache->lock);
+
+    // A missing or broken cache is simply empty
+    hFile = CreateFileW(file, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return;
+    if (GetFileSizeEx(hFile, &cb) && cb.QuadPart >= sizeof(CACHE_HEADER) && cb.QuadPart < MAXDWORD)
+        header = malloc(cb.LowPart);
+    if (header && ReadFile(hFile, header, cb.LowPart, &cbRead, NULL) && cbRead == cb.LowPart &&
+        header->dwMagic == CACHE_MAGIC && header->cbEntry == sizeof(CACHE_ENTRY) &&
+        header->cEntries == (cbRead - sizeof(CACHE_HEADER)) / sizeof(CACHE_ENTRY))
+    {
+        cache->pHeader = header;
+        cache->entries = (CACHE_ENTRY *)(header + 1);
+        cache->cEntries = header->cEntries;
+    }
+    else
+    {
+        free(header);
+    }
+    CloseHandle(hFile);
+}
+
+// Fills the metadata of the file into *entry.
+// Returns TRUE and the digest if the cache has an up-to-date entry.
+BOOL CacheLookup(CACHE *cache, LPCWSTR file, CACHE_ENTRY *entry)
+{
+    HANDLE hFile;
+    BY_HANDLE_FILE_INFORMATION info;
+    const CACHE_ENTRY *found;
+    DWORD iLow = 0, iHigh = cache->cEntries, iMid;
+    BOOL bOK;
+
+    ZeroMemory(entry, sizeof(*entry));
+
+    // reads the attributes only
+    hFile = CreateFileW(file, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                        NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+    bOK = GetFileInformationByHandle(hFile, &info);
+    CloseHandle(hFile);
+    if (!bOK)
+        return FALSE;
+
+    entry->key = CacheKey(file);
+    entry->cbFile = ((ULONGLONG)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    entry->ftLastWrite = ((ULONGLONG)info.ftLastWriteTime.dwHighDateTime << 32) |
+                         info.ftLastWriteTime.dwLowDateTime;
+    entry->fileIndex = ((ULONGLONG)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+    entry->dwVolume = info.dwVolumeSerialNumber;
+
+    while (iLow < iHigh)
+    {
+        iMid = iLow + (iHigh - iLow) / 2;
+        if (cache->entries[iMid].key < entry->key)
+            iLow = iMid + 1;
+        else
+            iHigh = iMid;
+    }
+    if (iLow >= cache->cEntries)
+        return FALSE;
+
+    found = &cache->entries[iLow];
+    if (found->key != entry->key || found->cbFile != entry->cbFile ||
+        found->ftLastWrite != entry->ftLastWrite || found->fileIndex != entry->fileIndex ||
+        found->dwVolume != entry->dwVolume)
+    {
+        return FALSE;
+    }
+    entry->digest = found->digest;
+    return TRUE;
+}
+
+// Remembers a new digest. This can be called from worker threads.
+VOID CacheStore(CACHE *cache, const CACHE_ENTRY *entry)
+{
+    CACHE_ENTRY *added;
+
+    if (!entry->key)
+        return; // no metadata
+
+    EnterCriticalSection(&cache->lock);
+    if (cache->cAdded >= cache->cCapacity)
+    {
+        added = realloc(cache->added, max(256, cache->cCapacity * 2) * sizeof(CACHE_ENTRY));
+        if (added)
+        {
+            cache->added = added;
+            cache->cCapacity = max(256, cache->cCapacity * 2);
+        }
+    }
+    if (cache->cAdded < cache->cCapacity)
+        cache->added[cache->cAdded++] = *entry;
+    LeaveCriticalSection(&cache->lock);
+}
+
+static int __cdecl CompareCacheEntries(const void *p0, const void *p1)
+{
+    const CACHE_ENTRY *entry0 = p0, *entry1 = p1;
+    if (entry0->key != entry1->key)
+        return (entry0->key < entry1->key) ? -1 : 1;
+    return 0;
+}
+
+// Merges the new entries into the cache file. The new entries win. A path too
+// long for the temporary file is reported here, and the save is skipped.
+BOOL CacheSave(CACHE *cache)
+{
+    CACHE_HEADER *header;
+    CACHE_ENTRY *entries;
+    DWORD i = 0, j = 0, k = 0, cb, cbWritten;
+    WCHAR szTemp[MAX_PATH];
+    HANDLE hFile;
+    BOOL bOK;
+
+    if (cache->cAdded == 0)
+        return TRUE;
+
+    // write a temporary file and replace, so that the cache is never half-written
+    if (FAILED(StringCbPrintfW(szTemp, sizeof(szTemp), L"%ls.tmp", cache->file)))
+    {
+        PathTooLong(cache->file);
+        return TRUE;
+    }
+
+    qsort(cache->added, cache->cAdded, sizeof(CACHE_ENTRY), CompareCacheEntries);
+
+    cb = sizeof(CACHE_HEADER) + (cache->cEntries + cache->cAdded) * sizeof(CACHE_ENTRY);
+    header = malloc(cb);
+    if (!header)
+        return FALSE;
+    entries = (CACHE_ENTRY *)(header + 1);
+
+    while (i < cache->cEntries || j < cache->cAdded)
+    {
+        if (j < cache->cAdded &&
+            (i >= cache->cEntries || cache->added[j].key <= cache->entries[i].key))
+        {
+            // a file digested twice in a run has the same metadata
+            while (j + 1 < cache->cAdded && cache->added[j + 1].key == cache->added[j].key)
+                ++j;
+            while (i < cache->cEntries && cache->entries[i].key == cache->added[j].key)
+                ++i;
+            entries[k++] = cache->added[j++];
+        }
+        else
+        {
+            entries[k++] = cache->entries[i++];
+        }
+    }
+
+    header->dwMagic = CACHE_MAGIC;
+    header->cbEntry = sizeof(CACHE_ENTRY);
+    header->cEntries = k;
+    header->dwReserved = 0;
+    cb = sizeof(CACHE_HEADER) + k * sizeof(CACHE_ENTRY);
+
+    hFile = CreateFileW(szTemp, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+    bOK = (hFile != INVALID_HANDLE_VALUE);
+    if (bOK)
+    {
+        bOK = WriteFile(hFile, header, cb, &cbWritten, NULL) && cbWritten == cb;
+        CloseHandle(hFile);
+        if (bOK)
+            bOK = MoveFileExW(szTemp, cache->file, MOVEFILE_REPLACE_EXISTING);
+        if (!bOK)
+            DeleteFileW(szTemp);
+    }
+    free(header);
+    return bOK;
+}
+
+VOID CacheFree(CACHE *cache)
+{
+    free(cache->pHeader);
+    free(cache->added);
+    DeleteCriticalSection(&cache->lock);
+    ZeroMemory(cache, sizeof(*cache));
+}
@@ -0,0 +1,89 @@
+/*
+ * PROJECT:     ReactOS FC Command
+ * LICENSE:     GPL-2.0-or-later (https://spdx.org/licenses/GPL-2.0-or-later)
+ * PURPOSE:     Detecting the instruction sets
+ * COPYRIGHT:   Copyright 2021 Katayama Hirofumi MZ (katayama.hirofumi.mz@gmail.com)
+ */
+#include "fc.h"
+#include "simd.h"
+
+#if defined(FC_X86) && !defined(_MSC_VER)
+    #include <cpuid.h>
+#endif
+
+#ifdef FC_X86
+static VOID CpuId(INT regs[4], INT leaf, INT subleaf)
+{
+#ifdef _MSC_VER
+    __cpuidex(regs, leaf, subleaf);
+#else
+    unsigned int a = 0, b = 0, c = 0, d = 0;
+    __cpuid_count(leaf, subleaf, a, b, c, d);
+    regs[0] = (INT)a;
+    regs[1] = (INT)b;
+    regs[2] = (INT)c;
+    regs[3] = (INT)d;
+#endif
+}
+
+static ULONGLONG GetXCR0(VOID)
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    unsigned int lo, hi;
+    __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((ULONGLONG)hi << 32) | lo;
+#endif
+}
+#endif /* def FC_X86 */
+
+static DWORD DetectCpuFeatures(VOID)
+{
+    DWORD dwFeatures = 0;
+#ifdef FC_X86
+    INT regs[4], nMaxLeaf;
+    ULONGLONG xcr0;
+
+    CpuId(regs, 0, 0);
+    nMaxLeaf = regs[0];
+    if (nMaxLeaf < 1)
+        return 0;
+
+    CpuId(regs, 1, 0);
+    if (regs[3] & (1 << 26))
+        dwFeatures |= CPU_SSE2;
+    if (!(regs[2] & (1 << 27)) || nMaxLeaf < 7) // OSXSAVE
+        return dwFeatures;
+
+    xcr0 = GetXCR0();
+    CpuId(regs, 7, 0);
+    // the OS must save the YMM (and ZMM) states
+    if ((xcr0 & 0x06) == 0x06 && (regs[1] & (1 << 5)))
+        dwFeatures |= CPU_AVX2;
+    if ((xcr0 & 0xE6) == 0xE6 && (regs[1] & (1 << 16)) && (regs[1] & (1 << 30)))
+        dwFeatures |= CPU_AVX512;
+#endif
+    return dwFeatures;
+}
+
+DWORD GetCpuFeatures(VOID)
+{
+    static volatile LONG s_dwFeatures = -1;
+    if (s_dwFeatures == -1)
+        InterlockedCompareExchange(&s_dwFeatures, (LONG)DetectCpuFeatures(), -1);
+    return (DWORD)s_dwFeatures;
+}
+
+// Returns *ppv, which pfnChoose chooses on the first call. If the threads race,
+// the first one to finish publishes its choice, and all of them return it.
+PVOID ChooseOnce(PVOID volatile *ppv, FN_CHOOSE pfnChoose)
+{
+    PVOID pv = *ppv, pvOld;
+    if (pv)
+        return pv;
+
+    pv = pfnChoose();
+    pvOld = InterlockedCompareExchangePointer(ppv, pv, NULL);
+    return (pvOld ? pvOld : pv);
+}
@@ -0,0 +1,219 @@
+/*
+ * PROJECT:     ReactOS FC Command
+ * LICENSE:     GPL-2.0-or-later (https://spdx.org/licenses/GPL-2.0-or-later)
+ * PURPOSE:     Fast non-cryptographic 128-bit digest of file contents
+ * COPYRIGHT:   Copyright 2021 Katayama Hirofumi MZ (katayama.hirofumi.mz@gmail.com)
+ */
+#include "fc.h"
+#include "simd.h"
+
+// The digest follows the structure of XXH3: eight 64-bit lanes accumulate
+// 64-byte stripes with 32x32->64 multiplications, which map directly onto
+// SSE2/AVX2, and the lanes are scrambled after each 1024-byte block.
+// It is not bit-compatible with XXH3. All implementations give the same value.
+
+#define STRIPE_SIZE 64
+#define STRIPES_PER_BLOCK (DIGEST_BLOCK_SIZE / STRIPE_SIZE)
+#define PRIME32_1 0x9E3779B1U
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+
+static const ULONGLONG s_keys[STRIPES_PER_BLOCK + 8] =
+{
+    0x9BCECD9576C53072ULL, 0xD207CA7EC114D5F0ULL, 0x51C21C463C6AA487ULL,
+    0xD9AFD98CF10AF0A1ULL, 0x7FDF0066A08662EEULL, 0xE5D04533F23C0BD5ULL,
+    0x86B173BE7D0C4A48ULL, 0x71234918515A1C42ULL, 0x995700A59439ED41ULL,
+    0xE5FCEFE085C7B2B3ULL, 0x23238198606C12EEULL, 0x3B50C6B5D553C4BDULL,
+    0x075D83F415C2972AULL, 0xC8FCA3835861D3CBULL, 0x5E91B572ECD799CFULL,
+    0x044AF1D9B8920877ULL, 0xA442D1B8F11DEEACULL, 0x440CB4804EE76A5AULL,
+    0x2246ED253607E527ULL, 0xCCF6230DDABAD7F8ULL, 0xDCAB2D1F1B108525ULL,
+    0x44371AEEF385B391ULL, 0x914AB52553380A01ULL, 0x7BE79C24754265AEULL,
+};
+
+typedef VOID (*FN_ACCUMULATE)(ULONGLONG *acc, const BYTE *pb, DWORD iStripe, DWORD cStripes);
+
+// Stripe #iStripe of a block uses the keys from s_keys[iStripe]
+static VOID AccumulateScalar(ULONGLONG *acc, const BYTE *pb, DWORD iStripe, DWORD cStripes)
+{
+    ULONGLONG data, key;
+    DWORD i;
+
+    for (; cStripes > 0; --cStripes, ++iStripe, pb += STRIPE_SIZE)
+    {
+        for (i = 0; i < 8; ++i)
+        {
+            memcpy(&data, &pb[i * 8], sizeof(data));
+            key = data ^ s_keys[iStripe + i];
+            acc[i ^ 1] += data;
+            acc[i] += (key & 0xFFFFFFFF) * (key >> 32);
+        }
+    }
+}
+
+#ifdef FC_X86
+TARGET_SSE2
+static VOID AccumulateSSE2(ULONGLONG *acc, const BYTE *pb, DWORD iStripe, DWORD cStripes)
+{
+    __m128i a[4], data, key;
+    INT i;
+
+    for (i = 0; i < 4; ++i)
+        a[i] = _mm_loadu_si128((const __m128i *)&acc[i * 2]);
+
+    for (; cStripes > 0; --cStripes, ++iStripe, pb += STRIPE_SIZE)
+    {
+        for (i = 0; i < 4; ++i)
+        {
+            data = _mm_loadu_si128((const __m128i *)&pb[i * 16]);
+            key = _mm_xor_si128(data, _mm_loadu_si128((const __m128i *)&s_keys[iStripe + i * 2]));
+            a[i] = _mm_add_epi64(a[i], _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2)));
+            a[i] = _mm_add_epi64(a[i], _mm_mul_epu32(key, _mm_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1))));
+        }
+    }
+
+    for (i = 0; i < 4; ++i)
+        _mm_storeu_si128((__m128i *)&acc[i * 2], a[i]);
+}
+
+TARGET_AVX2
+static VOID AccumulateAVX2(ULONGLONG *acc, const BYTE *pb, DWORD iStripe, DWORD cStripes)
+{
+    __m256i a[2], data, key;
+    INT i;
+
+    for (i = 0; i < 2; ++i)
+        a[i] = _mm256_loadu_si256((const __m256i *)&acc[i * 4]);
+
+    for (; cStripes > 0; --cStripes, ++iStripe, pb += STRIPE_SIZE)
+    {
+        for (i = 0; i < 2; ++i)
+        {
+            data = _mm256_loadu_si256((const __m256i *)&pb[i * 32]);
+            key = _mm256_xor_si256(data, _mm256_loadu_si256((const __m256i *)&s_keys[iStripe + i * 4]));
+            a[i] = _mm256_add_epi64(a[i], _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2)));
+            a[i] = _mm256_add_epi64(a[i], _mm256_mul_epu32(key, _mm256_shuffle_epi32(key, _MM_SHUFFLE(0, 3, 0, 1))));
+        }
+    }
+
+    for (i = 0; i < 2; ++i)
+        _mm256_storeu_si256((__m256i *)&acc[i * 4], a[i]);
+    _mm256_zeroupper();
+}
+#endif /* def FC_X86 */
+
+static PVOID ChooseAccumulate(VOID)
+{
+#ifdef FC_X86
+    DWORD dwFeatures = GetCpuFeatures();
+    if (dwFeatures & CPU_AVX2)
+        return (PVOID)AccumulateAVX2;
+    if (dwFeatures & CPU_SSE2)
+        return (PVOID)AccumulateSSE2;
+#endif
+    return (PVOID)AccumulateScalar;
+}
+
+static PVOID volatile s_pfnAccumulate = NULL;
+
+static VOID Scramble(ULONGLONG *acc)
+{
+    INT i;
+    for (i = 0; i < 8; ++i)
+    {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= s_keys[STRIPES_PER_BLOCK + i];
+        acc[i] *= PRIME32_1;
+    }
+}
+
+// The lower 64 bits XOR the upper 64 bits of the 128-bit product
+static ULONGLONG MulFold64(ULONGLONG a, ULONGLONG b)
+{
+    ULONGLONG aLo = (DWORD)a, aHi = a >> 32, bLo = (DWORD)b, bHi = b >> 32;
+    ULONGLONG lolo = aLo * bLo, hilo = aHi * bLo, lohi = aLo * bHi, hihi = aHi * bHi;
+    ULONGLONG cross = (lolo >> 32) + (DWORD)hilo + lohi;
+    ULONGLONG upper = (hilo >> 32) + (cross >> 32) + hihi;
+    ULONGLONG lower = (cross << 32) | (DWORD)lolo;
+    return lower ^ upper;
+}
+
+static ULONGLONG Avalanche(ULONGLONG h)
+{
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+static ULONGLONG MergeLanes(const ULONGLONG *acc, INT iKey, ULONGLONG h)
+{
+    INT i;
+    for (i = 0; i < 4; ++i)
+        h += MulFold64(acc[i * 2] ^ s_keys[iKey + i * 2], acc[i * 2 + 1] ^ s_keys[iKey + i * 2 + 1]);
+    return Avalanche(h);
+}
+
+VOID DigestInit(DIGEST_STATE *state)
+{
+    INT i;
+    ZeroMemory(state, sizeof(*state));
+    for (i = 0; i < 8; ++i)
+        state->acc[i] = s_keys[i] ^ PRIME64_1;
+}
+
+VOID DigestUpdate(DIGEST_STATE *state, const BYTE *pb, SIZE_T cb)
+{
+    FN_ACCUMULATE pfnAccumulate = (FN_ACCUMULATE)ChooseOnce(&s_pfnAccumulate, ChooseAccumulate);
+    DWORD cbCopy;
+
+    state->cbTotal += cb;
+
+    // complete the pending block first
+    if (state->cbBuffer > 0)
+    {
+        cbCopy = (DWORD)min(cb, DIGEST_BLOCK_SIZE - state->cbBuffer);
+        memcpy(&state->buffer[state->cbBuffer], pb, cbCopy);
+        state->cbBuffer += cbCopy;
+        pb += cbCopy;
+        cb -= cbCopy;
+        if (state->cbBuffer < DIGEST_BLOCK_SIZE || cb == 0)
+            return;
+        pfnAccumulate(state->acc, state->buffer, 0, STRIPES_PER_BLOCK);
+        Scramble(state->acc);
+        state->cbBuffer = 0;
+    }
+
+    // The last block is kept even if it is full, so that DigestFinal always has data
+    for (; cb > DIGEST_BLOCK_SIZE; pb += DIGEST_BLOCK_SIZE, cb -= DIGEST_BLOCK_SIZE)
+    {
+        pfnAccumulate(state->acc, pb, 0, STRIPES_PER_BLOCK);
+        Scramble(state->acc);
+    }
+
+    memcpy(state->buffer, pb, cb);
+    state->cbBuffer = (DWORD)cb;
+}
+
+VOID DigestFinal(DIGEST_STATE *state, DIGEST *digest)
+{
+    FN_ACCUMULATE pfnAccumulate = (FN_ACCUMULATE)ChooseOnce(&s_pfnAccumulate, ChooseAccumulate);
+    ULONGLONG acc[8];
+    BYTE stripe[STRIPE_SIZE];
+    DWORD cStripes, cbRest;
+
+    // the state can be finalized again after more updates
+    memcpy(acc, state->acc, sizeof(acc));
+
+    cStripes = state->cbBuffer / STRIPE_SIZE;
+    cbRest = state->cbBuffer % STRIPE_SIZE;
+    pfnAccumulate(acc, state->buffer, 0, cStripes);
+    if (cbRest > 0 || state->cbTotal == 0)
+    {
+        ZeroMemory(stripe, sizeof(stripe));
+        memcpy(stripe, &state->buffer[cStripes * STRIPE_SIZE], cbRest);
+        pfnAccumulate(acc, stripe, cStripes, 1);
+    }
+
+    digest->lo = MergeLanes(acc, 0, state->cbTotal * PRIME64_1);
+    digest->hi = MergeLanes(acc, 8, ~(state->cbTotal * PRIME64_2));
+}
@@ -0,0 +1,469 @@
+/*
+ * PROJECT:     ReactOS FC Command
+ * LICENSE:     GPL-2.0-or-later (https://spdx.org/licenses/GPL-2.0-or-later)
+ * PURPOSE:     Detecting and converting the encodings of text files
+ * COPYRIGHT:   Copyright 2021 Katayama Hirofumi MZ (katayama.hirofumi.mz@gmail.com)
+ */
+#include "fc.h"
+#include "simd.h"
+
+// The length of the UTF-8 sequence at pb. Zero if it is invalid, or -1 if it is
+// valid so far but cut off at pb + cb. The overlongs, the surrogates and the
+// code points past U+10FFFF are invalid.
+static INT Utf8Length(const BYTE *pb, DWORD cb)
+{
+    BYTE lo = 0x80, hi = 0xBF;
+    INT cbSeq, ib;
+
+    if (pb[0] < 0x80)
+        return 1;
+    if (pb[0] < 0xC2 || pb[0] > 0xF4)
+        return 0;
+    cbSeq = (pb[0] < 0xE0) ? 2 : ((pb[0] < 0xF0) ? 3 : 4);
+
+    // the second byte is limited for the lead bytes on the edges
+    if (pb[0] == 0xE0)
+        lo = 0xA0;
+    else if (pb[0] == 0xED)
+        hi = 0x9F;
+    else if (pb[0] == 0xF0)
+        lo = 0x90;
+    else if (pb[0] == 0xF4)
+        hi = 0x8F;
+
+    for (ib = 1; ib < cbSeq; ++ib)
+    {
+        if ((DWORD)ib >= cb)
+            return -1;
+        if (pb[ib] < lo || pb[ib] > hi)
+            return 0;
+        lo = 0x80;
+        hi = 0xBF;
+    }
+    return cbSeq;
+}
+
+#define DETECT_RATIO 8
+
+// The byte order mark decides the encoding. Without it, the head of the file is
+// guessed unless /U or /L is given: UTF-16 if a half of the high bytes are
+// zero and few of the low bytes are, or UTF-8 if it is valid and not ASCII.
+ENCODING DetectEncoding(DWORD dwFlags, const BYTE *pb, DWORD cb, DWORD *pcbBOM)
+{
+    DWORD ib, cZeros[2] = { 0, 0 };
+    BOOL bNonAscii = FALSE;
+    INT cbSeq;
+
+    *pcbBOM = 0;
+    if (cb >= 3 && pb[0] == 0xEF && pb[1] == 0xBB && pb[2] == 0xBF)
+    {
+        *pcbBOM = 3;
+        return ENCODING_UTF8;
+    }
+    if (cb >= 2 && pb[0] == 0xFF && pb[1] == 0xFE)
+    {
+        *pcbBOM = 2;
+        return ENCODING_UTF16LE;
+    }
+    if (cb >= 2 && pb[0] == 0xFE && pb[1] == 0xFF)
+    {
+        *pcbBOM = 2;
+        return ENCODING_UTF16BE;
+    }
+
+    if (dwFlags & FLAG_U)
+        return ENCODING_UTF16LE;
+    if (dwFlags & FLAG_L)
+        return ENCODING_ANSI;
+
+    for (ib = 0; ib + 1 < cb; ib += 2)
+    {
+        cZeros[0] += (pb[ib] == 0);
+        cZeros[1] += (pb[ib + 1] == 0);
+    }
+    if (cZeros[1] > 0 && cZeros[1] >= cb / 4 && cZeros[0] * DETECT_RATIO <= cZeros[1])
+        return ENCODING_UTF16LE;
+    if (cZeros[0] > 0 && cZeros[0] >= cb / 4 && cZeros[1] * DETECT_RATIO <= cZeros[0])
+        return ENCODING_UTF16BE;
+
+    for (ib = 0; ib < cb; ib += cbSeq)
+    {
+        cbSeq = Utf8Length(&pb[ib], cb - ib);
+        if (cbSeq < 0) // cut off by the end of the head
+            break;
+        if (cbSeq == 0)
+            return ENCODING_ANSI;
+        if (cbSeq > 1)
+            bNonAscii = TRUE;
+    }
+    return (bNonAscii ? ENCODING_UTF8 : ENCODING_ANSI);
+}
+
+typedef DWORD (*FN_CONVERT)(const BYTE *pb, DWORD cb, LPWSTR pch);
+typedef DWORD (*FN_DECODE)(const BYTE *pb, DWORD cb, LPWSTR pch, DWORD *pcch);
+
+// Widens the ASCII characters at pb up to the first other one. Returns the # of them.
+static DWORD WidenAsciiScalar(const BYTE *pb, DWORD cb, LPWSTR pch)
+{
+    DWORD ib;
+    for (ib = 0; ib < cb && pb[ib] < 0x80; ++ib)
+        pch[ib] = pb[ib];
+    return ib;
+}
+
+// Decodes the valid UTF-8 at pb up to a character that needs the scalar code.
+// Returns the # of the bytes used, and *pcch receives the # of the characters.
+// Only the ASCII is decoded here; the vectorized versions do more.
+static DWORD DecodeUtf8Scalar(const BYTE *pb, DWORD cb, LPWSTR pch, DWORD *pcch)
+{
+    *pcch = WidenAsciiScalar(pb, cb, pch);
+    return *pcch;
+}
+
+// Converts the big-endian UTF-16 code units at pb. Returns the # of them.
+static DWORD SwapBytesScalar(const BYTE *pb, DWORD cb, LPWSTR pch)
+{
+    DWORD ich;
+    for (ich = 0; 2 * ich + 1 < cb; ++ich)
+        pch[ich] = (WCHAR)((pb[2 * ich] << 8) | pb[2 * ich + 1]);
+    return ich;
+}
+
+#ifdef FC_X86
+// The vectorized decoders take a window of the characters that begin in the
+// next 16 or 32 bytes. If they are all of 1 to 3 bytes and valid, they are
+// decoded at once; otherwise the scalar code takes the next character. The
+// last characters of the window may end in the 2 bytes after it.
+#define UTF8_WINDOW_EXTRA 2
+
+// Stores the characters at the lead bytes of the window. Returns the # of them.
+static __inline DWORD CompactWindow(const WCHAR *pchWindow, ULONGLONG leads, LPWSTR pch)
+{
+    DWORD ich = 0;
+    for (; leads; leads &= leads - 1)
+        pch[ich++] = pchWindow[LowestBit64(leads)];
+    return ich;
+}
+
+// The characters of the 16-bit lanes, as if each one were a lead byte. w1 and
+// w2 are the next bytes.
+TARGET_SSE2
+static __inline __m128i DecodeLanesSSE2(__m128i w0, __m128i w1, __m128i w2)
+{
+    const __m128i m3F = _mm_set1_epi16(0x3F);
+    __m128i trail1 = _mm_slli_epi16(_mm_and_si128(w1, m3F), 6);
+    __m128i cp2 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(w0, _mm_set1_epi16(0x1F)), 6),
+                               _mm_and_si128(w1, m3F));
+    __m128i cp3 = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(w0, 12), trail1),
+                               _mm_and_si128(w2, m3F));
+    __m128i is1 = _mm_cmplt_epi16(w0, _mm_set1_epi16(0x80));
+    __m128i is3 = _mm_cmpgt_epi16(w0, _mm_set1_epi16(0xDF));
+    __m128i cp = _mm_or_si128(_mm_and_si128(is3, cp3), _mm_andnot_si128(is3, cp2));
+    return _mm_or_si128(_mm_and_si128(is1, w0), _mm_andnot_si128(is1, cp));
+}
+
+TARGET_SSE2
+static DWORD DecodeUtf8SSE2(const BYTE *pb, DWORD cb, LPWSTR pch, DWORD *pcch)
+{
+    const __m128i zero = _mm_setzero_si128();
+    WCHAR achWindow[16];
+    DWORD ib = 0, ich = 0, cchTail, ascii, cont0, cont1, cont2, lead2, lead3, bad, expected;
+    __m128i x0, x1, x2, isLow;
+
+    while (ib + 16 + UTF8_WINDOW_EXTRA <= cb)
+    {
+        x0 = _mm_loadu_si128((const __m128i *)&pb[ib]);
+        ascii = ~(DWORD)_mm_movemask_epi8(x0) & 0xFFFF;
+        if (ascii == 0xFFFF)
+        {
+            _mm_storeu_si128((__m128i *)&pch[ich], _mm_unpacklo_epi8(x0, zero));
+            _mm_storeu_si128((__m128i *)&pch[ich + 8], _mm_unpackhi_epi8(x0, zero));
+            ib += 16;
+            ich += 16;
+            continue;
+        }
+
+        // as signed bytes, 80..BF are below C0 and the ASCII is not
+        x1 = _mm_loadu_si128((const __m128i *)&pb[ib + 1]);
+        x2 = _mm_loadu_si128((const __m128i *)&pb[ib + 2]);
+        cont0 = (DWORD)_mm_movemask_epi8(_mm_cmplt_epi8(x0, _mm_set1_epi8((CHAR)0xC0)));
+        cont1 = (DWORD)_mm_movemask_epi8(_mm_cmplt_epi8(x1, _mm_set1_epi8((CHAR)0xC0)));
+        cont2 = (DWORD)_mm_movemask_epi8(_mm_cmplt_epi8(x2, _mm_set1_epi8((CHAR)0xC0)));
+        lead2 = (DWORD)_mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(x0, _mm_set1_epi8((CHAR)0xC1)),
+                                                       _mm_cmplt_epi8(x0, _mm_set1_epi8((CHAR)0xE0))));
+        lead3 = (DWORD)_mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(x0, _mm_set1_epi8((CHAR)0xDF)),
+                                                       _mm_cmplt_epi8(x0, _mm_set1_epi8((CHAR)0xF0))));
+        // E0 needs A0..BF (no overlongs), and ED needs 80..9F (no surrogates)
+        isLow = _mm_cmplt_epi8(x1, _mm_set1_epi8((CHAR)0xA0));
+        bad = (DWORD)_mm_movemask_epi8(
+            _mm_or_si128(_mm_and_si128(_mm_cmpeq_epi8(x0, _mm_set1_epi8((CHAR)0xE0)), isLow),
+                         _mm_andnot_si128(isLow, _mm_cmpeq_epi8(x0, _mm_set1_epi8((CHAR)0xED)))));
+
+        // every continuation byte is expected, and every expected one is there
+        expected = ((lead2 | lead3) << 1) | (lead3 << 2);
+        if ((ascii | cont0 | lead2 | lead3) != 0xFFFF || bad || (lead2 & ~cont1) ||
+            (lead3 & ~(cont1 & cont2)) || (expected & 0xFFFF) != cont0)
+        {
+            break;
+        }
+
+        _mm_storeu_si128((__m128i *)&achWindow[0],
+                         DecodeLanesSSE2(_mm_unpacklo_epi8(x0, zero), _mm_unpacklo_epi8(x1, zero),
+                                         _mm_unpacklo_epi8(x2, zero)));
+        _mm_storeu_si128((__m128i *)&achWindow[8],
+                         DecodeLanesSSE2(_mm_unpackhi_epi8(x0, zero), _mm_unpackhi_epi8(x1, zero),
+                                         _mm_unpackhi_epi8(x2, zero)));
+        ich += CompactWindow(achWindow, ~cont0 & 0xFFFF, &pch[ich]);
+        ib += 16 + ((expected >> 16) & 1) + ((expected >> 17) & 1);
+    }
+
+    cchTail = WidenAsciiScalar(&pb[ib], cb - ib, &pch[ich]);
+    *pcch = ich + cchTail;
+    return ib + cchTail;
+}
+
+TARGET_SSE2
+static DWORD SwapBytesSSE2(const BYTE *pb, DWORD cb, LPWSTR pch)
+{
+    DWORD ich = 0;
+    __m128i x;
+
+    for (; 2 * ich + 16 <= cb; ich += 8)
+    {
+        x = _mm_loadu_si128((const __m128i *)&pb[2 * ich]);
+        x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+        _mm_storeu_si128((__m128i *)&pch[ich], x);
+    }
+    return ich + SwapBytesScalar(&pb[2 * ich], cb - 2 * ich, &pch[ich]);
+}
+
+TARGET_AVX2
+static __inline __m256i DecodeLanesAVX2(__m256i w0, __m256i w1, __m256i w2)
+{
+    const __m256i m3F = _mm256_set1_epi16(0x3F);
+    __m256i trail1 = _mm256_slli_epi16(_mm256_and_si256(w1, m3F), 6);
+    __m256i cp2 = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(w0, _mm256_set1_epi16(0x1F)), 6),
+                                  _mm256_and_si256(w1, m3F));
+    __m256i cp3 = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi16(w0, 12), trail1),
+                                  _mm256_and_si256(w2, m3F));
+    __m256i is1 = _mm256_cmpgt_epi16(_mm256_set1_epi16(0x80), w0);
+    __m256i is3 = _mm256_cmpgt_epi16(w0, _mm256_set1_epi16(0xDF));
+    __m256i cp = _mm256_blendv_epi8(cp2, cp3, is3);
+    return _mm256_blendv_epi8(cp, w0, is1);
+}
+
+TARGET_AVX2
+static DWORD DecodeUtf8AVX2(const BYTE *pb, DWORD cb, LPWSTR pch, DWORD *pcch)
+{
+    WCHAR achWindow[32];
+    DWORD ib = 0, ich = 0, cchTail, ascii, cont0, cont1, cont2, lead2, lead3, bad;
+    ULONGLONG expected;
+    __m256i x0, x1, x2, isLow;
+
+    while (ib + 32 + UTF8_WINDOW_EXTRA <= cb)
+    {
+        x0 = _mm256_loadu_si256((const __m256i *)&pb[ib]);
+        ascii = ~(DWORD)_mm256_movemask_epi8(x0);
+        if (ascii == 0xFFFFFFFF)
+        {
+            _mm256_storeu_si256((__m256i *)&pch[ich], _mm256_cvtepu8_epi16(_mm256_castsi256_si128(x0)));
+            _mm256_storeu_si256((__m256i *)&pch[ich + 16],
+                                _mm256_cvtepu8_epi16(_mm256_extracti128_si256(x0, 1)));
+            ib += 32;
+            ich += 32;
+            continue;
+        }
+
+        // as signed bytes, 80..BF are below C0 and the ASCII is not
+        x1 = _mm256_loadu_si256((const __m256i *)&pb[ib + 1]);
+        x2 = _mm256_loadu_si256((const __m256i *)&pb[ib + 2]);
+        cont0 = (DWORD)_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_set1_epi8((CHAR)0xC0), x0));
+        cont1 = (DWORD)_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_set1_epi8((CHAR)0xC0), x1));
+        cont2 = (DWORD)_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_set1_epi8((CHAR)0xC0), x2));
+        lead2 = (DWORD)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpgt_epi8(x0, _mm256_set1_epi8((CHAR)0xC1)),
+                             _mm256_cmpgt_epi8(_mm256_set1_epi8((CHAR)0xE0), x0)));
+        lead3 = (DWORD)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpgt_epi8(x0, _mm256_set1_epi8((CHAR)0xDF)),
+                             _mm256_cmpgt_epi8(_mm256_set1_epi8((CHAR)0xF0), x0)));
+        // E0 needs A0..BF (no overlongs), and ED needs 80..9F (no surrogates)
+        isLow = _mm256_cmpgt_epi8(_mm256_set1_epi8((CHAR)0xA0), x1);
+        bad = (DWORD)_mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi8(x0, _mm256_set1_epi8((CHAR)0xE0)), isLow),
+            _mm256_andnot_si256(isLow, _mm256_cmpeq_epi8(x0, _mm256_set1_epi8((CHAR)0xED)))));
+
+        // every continuation byte is expected, and every expected one is there
+        expected = ((ULONGLONG)(lead2 | lead3) << 1) | ((ULONGLONG)lead3 << 2);
+        if ((ascii | cont0 | lead2 | lead3) != 0xFFFFFFFF || bad || (lead2 & ~cont1) ||
+            (lead3 & ~(cont1 & cont2)) || (DWORD)expected != cont0)
+        {
+            break;
+        }
+
+        _mm256_storeu_si256((__m256i *)&achWindow[0],
+                            DecodeLanesAVX2(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(x0)),
+                                            _mm256_cvtepu8_epi16(_mm256_castsi256_si128(x1)),
+                                            _mm256_cvtepu8_epi16(_mm256_castsi256_si128(x2))));
+        _mm256_storeu_si256((__m256i *)&achWindow[16],
+                            DecodeLanesAVX2(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(x0, 1)),
+                                            _mm256_cvtepu8_epi16(_mm256_extracti128_si256(x1, 1)),
+                                            _mm256_cvtepu8_epi16(_mm256_extracti128_si256(x2, 1))));
+        ich += CompactWindow(achWindow, ~cont0, &pch[ich]);
+        ib += 32 + (DWORD)((expected >> 32) & 1) + (DWORD)((expected >> 33) & 1);
+    }
+
+    _mm256_zeroupper();
+    cchTail = WidenAsciiScalar(&pb[ib], cb - ib, &pch[ich]);
+    *pcch = ich + cchTail;
+    return ib + cchTail;
+}
+
+TARGET_AVX2
+static DWORD SwapBytesAVX2(const BYTE *pb, DWORD cb, LPWSTR pch)
+{
+    DWORD ich = 0;
+    __m256i x;
+
+    for (; 2 * ich + 32 <= cb; ich += 16)
+    {
+        x = _mm256_loadu_si256((const __m256i *)&pb[2 * ich]);
+        x = _mm256_or_si256(_mm256_slli_epi16(x, 8), _mm256_srli_epi16(x, 8));
+        _mm256_storeu_si256((__m256i *)&pch[ich], x);
+    }
+
+    _mm256_zeroupper();
+    return ich + SwapBytesScalar(&pb[2 * ich], cb - 2 * ich, &pch[ich]);
+}
+#endif /* def FC_X86 */
+
+// The converters are chosen together, so that they are published at once
+typedef struct CONVERTERS
+{
+    FN_DECODE pfnDecodeUtf8;
+    FN_CONVERT pfnSwapBytes;
+} CONVERTERS;
+
+static const CONVERTERS s_convertersScalar = { DecodeUtf8Scalar, SwapBytesScalar };
+#ifdef FC_X86
+static const CONVERTERS s_convertersSSE2 = { DecodeUtf8SSE2, SwapBytesSSE2 };
+static const CONVERTERS s_convertersAVX2 = { DecodeUtf8AVX2, SwapBytesAVX2 };
+#endif
+
+static PVOID ChooseConverters(VOID)
+{
+#ifdef FC_X86
+    DWORD dwFeatures = GetCpuFeatures();
+    if (dwFeatures & CPU_AVX2)
+        return (PVOID)&s_convertersAVX2;
+    if (dwFeatures & CPU_SSE2)
+        return (PVOID)&s_convertersSSE2;
+#endif
+    return (PVOID)&s_convertersScalar;
+}
+
+static PVOID volatile s_pConverters = NULL;
+
+// The invalid sequences become U+FFFD a byte at a time
+static DWORD DecodeUtf8(FN_DECODE pfnDecodeUtf8, const BYTE *pb, DWORD cb, LPWSTR pch,
+                        BOOL bFinal, DWORD *pcbUsed)
+{
+    DWORD ib = 0, ich = 0, cp, cchRun;
+    INT cbSeq, i;
+
+    while (ib < cb)
+    {
+        // the runs of the valid characters are decoded in vectors, up to a
+        // character that is not ASCII
+        ib += pfnDecodeUtf8(&pb[ib], cb - ib, &pch[ich], &cchRun);
+        ich += cchRun;
+        if (ib >= cb)
+            break;
+
+        cbSeq = Utf8Length(&pb[ib], cb - ib);
+        if (cbSeq < 0 && !bFinal) // the rest is in the next block
+            break;
+        if (cbSeq <= 0)
+        {
+            pch[ich++] = 0xFFFD;
+            ++ib;
+            continue;
+        }
+
+        cp = pb[ib] & (0x7F >> cbSeq);
+        for (i = 1; i < cbSeq; ++i)
+            cp = (cp << 6) | (pb[ib + i] & 0x3F);
+        if (cp >= 0x10000)
+        {
+            cp -= 0x10000;
+            pch[ich++] = (WCHAR)(0xD800 + (cp >> 10));
+            pch[ich++] = (WCHAR)(0xDC00 + (cp & 0x3FF));
+        }
+        else
+        {
+            pch[ich++] = (WCHAR)cp;
+        }
+        ib += cbSeq;
+    }
+
+    *pcbUsed = ib;
+    return ich;
+}
+
+static DWORD DecodeAnsi(const CONVERTERS *converters, const BYTE *pb, DWORD cb, LPWSTR pch,
+                        BOOL bFinal, DWORD *pcbUsed)
+{
+    CPINFO info;
+    DWORD ib;
+
+    // IsDBCSLeadByte knows nothing of UTF-8
+    if (GetACP() == CP_UTF8)
+        return DecodeUtf8(converters->pfnDecodeUtf8, pb, cb, pch, bFinal, pcbUsed);
+
+    // a lead byte at the end waits for its trail byte
+    if (!bFinal && GetCPInfo(CP_ACP, &info) && info.MaxCharSize > 1)
+    {
+        for (ib = 0; ib < cb; ib += (IsDBCSLeadByte(pb[ib]) ? 2 : 1))
+            ;
+        if (ib > cb)
+            --cb;
+    }
+
+    *pcbUsed = cb;
+    if (cb == 0)
+        return 0;
+    return (DWORD)MultiByteToWideChar(CP_ACP, 0, (LPCSTR)pb, (INT)cb, pch, (INT)cb);
+}
+
+// Converts the bytes to UTF-16. At most cb characters are written. The
+// character cut off at the end is left unless bFinal, and *pcbUsed receives
+// the # of the bytes converted.
+DWORD DecodeText(ENCODING nEncoding, const BYTE *pb, DWORD cb, LPWSTR pch, BOOL bFinal,
+                 DWORD *pcbUsed)
+{
+    const CONVERTERS *converters = ChooseOnce(&s_pConverters, ChooseConverters);
+    DWORD ich;
+
+    switch (nEncoding)
+    {
+        case ENCODING_UTF8:
+            return DecodeUtf8(converters->pfnDecodeUtf8, pb, cb, pch, bFinal, pcbUsed);
+        case ENCODING_UTF16LE:
+            ich = cb / sizeof(WCHAR);
+            CopyMemory(pch, pb, ich * sizeof(WCHAR));
+            break;
+        case ENCODING_UTF16BE:
+            ich = converters->pfnSwapBytes(pb, cb, pch);
+            break;
+        default:
+            return DecodeAnsi(converters, pb, cb, pch, bFinal, pcbUsed);
+    }
+
+    // the odd byte at the end of the file
+    *pcbUsed = 2 * ich;
+    if (bFinal && (cb & 1))
+    {
+        pch[ich++] = 0xFFFD;
+        *pcbUsed = cb;
+    }
+    return ich;
+}
@@ -43,96 +43,1036 @@
 #include <strsafe.h>
 #include <shlwapi.h>
 
+// The output sink formats records straight into a big buffer and writes it in chunks
+#define OUTPUT_BUFFER_SIZE (64 * 1024) // in WCHARs
+
+static WCHAR s_szOutput[OUTPUT_BUFFER_SIZE + 1];
+static SIZE_T s_cchOutput = 0;
+
+STATS *g_pStats = NULL; // non-NULL if /STATS
+
+#ifdef _MSC_VER
+    #define THREAD_LOCAL __declspec(thread)
+#else
+    #define THREAD_LOCAL __thread
+#endif
+
+// Only the main thread prints. A worker thread formats its report here
+// instead, and it is printed in order by the main thread.
+static THREAD_LOCAL DEFERRED_OUTPUT *s_pDeferred = NULL;
+
+VOID DeferOutput(DEFERRED_OUTPUT *output)
+{
+    if (output)
+        ZeroMemory(output, sizeof(*output));
+    s_pDeferred = output;
+}
+
+VOID FreeDeferredOutput(DEFERRED_OUTPUT *output)
+{
+    free(output->pch);
+    free(output->pszError);
+    ZeroMemory(output, sizeof(*output));
+}
+
+// Formats a message of the resources into a new string
+static LPWSTR LoadMessageV(UINT nID, va_list va)
+{
+    WCHAR szFormat[MAX_PATH];
+    LPWSTR psz = malloc(3 * MAX_PATH * sizeof(WCHAR));
+    if (!psz)
+        return NULL;
+    LoadStringW(NULL, nID, szFormat, _countof(szFormat));
+    StringCchVPrintfW(psz, 3 * MAX_PATH, szFormat, va);
+    return psz;
+}
+
+// Returns TRUE if the calling thread must not print. The first error is kept.
+static BOOL DeferError(UINT nID, ...)
+{
+    va_list va;
+    if (!s_pDeferred)
+        return FALSE;
+    if (!s_pDeferred->pszError)
+    {
+        va_start(va, nID);
+        s_pDeferred->pszError = LoadMessageV(nID, va);
+        va_end(va);
+        if (!s_pDeferred->pszError)
+            s_pDeferred->bNoMemory = TRUE;
+        s_pDeferred->ichError = s_pDeferred->cch;
+    }
+    return TRUE;
+}
+
+static VOID OutputCharsW(LPCWSTR pch, SIZE_T cch);
+
+// Returns TRUE if the calling thread must not print. The message is kept in
+// the deferred output.
+static BOOL DeferMessage(UINT nID, ...)
+{
+    va_list va;
+    LPWSTR psz;
+    if (!s_pDeferred)
+        return FALSE;
+    va_start(va, nID);
+    psz = LoadMessageV(nID, va);
+    va_end(va);
+    if (psz)
+        OutputCharsW(psz, wcslen(psz));
+    else
+        s_pDeferred->bNoMemory = TRUE;
+    free(psz);
+    return TRUE;
+}
+
+// Makes room for cch more characters of the deferred output, or returns NULL
+static LPWSTR ReserveDeferred(SIZE_T cch)
+{
+    DEFERRED_OUTPUT *output = s_pDeferred;
+    SIZE_T cchMax = max(output->cchMax, 4096);
+    LPWSTR pch;
+
+    while (output->cch + cch > cchMax)
+        cchMax *= 2;
+    if (cchMax > output->cchMax)
+    {
+        pch = realloc(output->pch, cchMax * sizeof(WCHAR));
+        if (!pch)
+        {
+            output->bNoMemory = TRUE;
+            return NULL;
+        }
+        output->pch = pch;
+        output->cchMax = cchMax;
+    }
+    return &output->pch[output->cch];
+}
+
+static VOID FlushOutput(VOID)
+{
+    LONGLONG t0;
+    if (s_cchOutput == 0 || s_pDeferred)
+        return;
+    t0 = STATS_START();
+    s_szOutput[s_cchOutput] = 0;
+    ConPuts(StdOut, s_szOutput);
+    STATS_ADD(cchWritten, s_cchOutput);
+    STATS_STOP(qpcOutput, t0);
+    s_cchOutput = 0;
+}
+
+// Returns NULL if the deferred output has run out of memory
+static __inline LPWSTR ReserveOutput(SIZE_T cch)
+{
+    if (s_pDeferred)
+        return ReserveDeferred(cch);
+    if (s_cchOutput + cch > OUTPUT_BUFFER_SIZE)
+        FlushOutput();
+    return &s_szOutput[s_cchOutput];
+}
+
+// Adds the cch characters written at ReserveOutput()
+static __inline VOID CommitOutput(SIZE_T cch)
+{
+    if (s_pDeferred)
+        s_pDeferred->cch += cch;
+    else
+        s_cchOutput += cch;
+}
+
+static VOID OutputCharsW(LPCWSTR pch, SIZE_T cch)
+{
+    SIZE_T cchChunk;
+    LPWSTR pchOutput;
+    while (cch > 0)
+    {
+        cchChunk = min(cch, OUTPUT_BUFFER_SIZE);
+        pchOutput = ReserveOutput(cchChunk);
+        if (!pchOutput)
+            return;
+        memcpy(pchOutput, pch, cchChunk * sizeof(WCHAR));
+        CommitOutput(cchChunk);
+        pch += cchChunk;
+        cch -= cchChunk;
+    }
+}
+
+static VOID OutputCharsA(LPCSTR pch, SIZE_T cch)
+{
+    LPWSTR pszWide;
+    INT cchWide;
+
+    if (cch == 0)
+        return;
+
+    // a converted string never has more WCHARs than the source has bytes
+    if (cch <= OUTPUT_BUFFER_SIZE)
+    {
+        pszWide = ReserveOutput(cch);
+        if (!pszWide)
+            return;
+        cchWide = MultiByteToWideChar(CP_ACP, 0, pch, (INT)cch, pszWide, (INT)cch);
+        CommitOutput(cchWide);
+        return;
+    }
+
+    pszWide = malloc(cch * sizeof(WCHAR));
+    if (!pszWide)
+        return;
+    cchWide = MultiByteToWideChar(CP_ACP, 0, pch, (INT)cch, pszWide, (INT)cch);
+    OutputCharsW(pszWide, cchWide);
+    free(pszWide);
+}
+
+#define OutputStringW(psz) OutputCharsW((psz), wcslen(psz))
+
+static VOID OutputHex(ULONGLONG value, INT cDigits)
+{
+    static const WCHAR s_szHex[] = L"0123456789ABCDEF";
+    LPWSTR pch = ReserveOutput(cDigits);
+    INT i;
+    if (!pch)
+        return;
+    for (i = cDigits - 1; i >= 0; --i)
+    {
+        pch[i] = s_szHex[value & 0xF];
+        value >>= 4;
+    }
+    CommitOutput(cDigits);
+}
+
+// Same as L"%5u"
+static VOID OutputLineNumber(DWORD lineno)
+{
+    WCHAR sz[16];
+    INT ich = (INT)_countof(sz);
+    do
+    {
+        sz[--ich] = (WCHAR)(L'0' + lineno % 10);
+        lineno /= 10;
+    } while (lineno);
+    while (ich > (INT)_countof(sz) - 5)
+        sz[--ich] = L' ';
+    OutputCharsW(&sz[ich], _countof(sz) - ich);
+}
+
+LONGLONG StatsNow(VOID)
+{
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart;
+}
+
+VOID StatsMax(LONGLONG *pValue, LONGLONG value)
+{
+    LONGLONG old;
+    while ((old = *(volatile LONGLONG *)pValue) < value &&
+           InterlockedCompareExchange64(pValue, value, old) != old)
+    {
+        ; // another thread has changed it
+    }
+}
+
+// Prints the counters and the timings of /STATS to the standard error
+static VOID PrintStats(const STATS *stats)
+{
+    static const struct
+    {
+        LPCWSTR name;
+        SIZE_T ib; // offset in STATS
+        BOOL bTime;
+    } s_fields[] = {
+        { L"bytes_mapped", FIELD_OFFSET(STATS, cbMapped), FALSE },
+        { L"views_mapped", FIELD_OFFSET(STATS, cViews), FALSE },
+        { L"bytes_streamed", FIELD_OFFSET(STATS, cbStreamed), FALSE },
+        { L"bytes_touched", FIELD_OFFSET(STATS, cbTouched), FALSE },
+        { L"lines_parsed", FIELD_OFFSET(STATS, cLines), FALSE },
+        { L"allocations", FIELD_OFFSET(STATS, cAllocs), FALSE },
+        { L"line_compares", FIELD_OFFSET(STATS, cLineCompares), FALSE },
+        { L"text_compares", FIELD_OFFSET(STATS, cTextCompares), FALSE },
+        { L"hash_rejects", FIELD_OFFSET(STATS, cHashRejects), FALSE },
+        { L"resyncs", FIELD_OFFSET(STATS, cResyncs), FALSE },
+        { L"resync_lines", FIELD_OFFSET(STATS, cResyncLines), FALSE },
+        { L"resync_max_window", FIELD_OFFSET(STATS, cResyncMaxWindow), FALSE },
+        { L"chars_written", FIELD_OFFSET(STATS, cchWritten), FALSE },
+        { L"map_ms", FIELD_OFFSET(STATS, qpcMap), TRUE },
+        { L"read_ms", FIELD_OFFSET(STATS, qpcRead), TRUE },
+        { L"parse_ms", FIELD_OFFSET(STATS, qpcParse), TRUE },
+        { L"resync_ms", FIELD_OFFSET(STATS, qpcResync), TRUE },
+        { L"output_ms", FIELD_OFFSET(STATS, qpcOutput), TRUE },
+        { L"total_ms", FIELD_OFFSET(STATS, qpcTotal), TRUE },
+    };
+    LARGE_INTEGER freq;
+    LONGLONG value;
+    INT i;
+
+    QueryPerformanceFrequency(&freq);
+    if (stats->bJSON)
+        ConPuts(StdErr, L"{");
+    for (i = 0; i < (INT)_countof(s_fields); ++i)
+    {
+        value = *(const LONGLONG *)((const BYTE *)stats + s_fields[i].ib);
+        if (stats->bJSON)
+        {
+            if (s_fields[i].bTime)
+                ConPrintf(StdErr, L"%ls\"%ls\":%.3f", (i ? L"," : L""), s_fields[i].name,
+                          value * 1000.0 / freq.QuadPart);
+            else
+                ConPrintf(StdErr, L"%ls\"%ls\":%I64d", (i ? L"," : L""), s_fields[i].name, value);
+        }
+        else
+        {
+            if (s_fields[i].bTime)
+                ConPrintf(StdErr, L"%-18ls %.3f\n", s_fields[i].name, value * 1000.0 / freq.QuadPart);
+            else
+                ConPrintf(StdErr, L"%-18ls %I64d\n", s_fields[i].name, value);
+        }
+    }
+    if (stats->bJSON)
+        ConPuts(StdErr, L"}\n");
+}
+
 FCRET NoDifference(VOID)
 {
+    if (DeferMessage(IDS_NO_DIFFERENCE))
+        return FCRET_IDENTICAL;
+    FlushOutput();
     ConResPuts(StdOut, IDS_NO_DIFFERENCE);
     return FCRET_IDENTICAL;
 }
 
 FCRET Different(LPCWSTR file0, LPCWSTR file1)
 {
+    if (DeferMessage(IDS_DIFFERENT, file0, file1))
+        return FCRET_DIFFERENT;
+    FlushOutput();
     ConResPrintf(StdOut, IDS_DIFFERENT, file0, file1);
     return FCRET_DIFFERENT;
 }
 
 FCRET LongerThan(LPCWSTR file0, LPCWSTR file1)
 {
+    if (DeferMessage(IDS_LONGER_THAN, file0, file1))
+        return FCRET_DIFFERENT;
+    FlushOutput();
     ConResPrintf(StdOut, IDS_LONGER_THAN, file0, file1);
     return FCRET_DIFFERENT;
 }
 
+FCRET OnlyIn(LPCWSTR file, LPCWSTR dir)
+{
+    if (DeferMessage(IDS_ONLY_IN, file, dir))
+        return FCRET_DIFFERENT;
+    FlushOutput();
+    ConResPrintf(StdOut, IDS_ONLY_IN, file, dir);
+    return FCRET_DIFFERENT;
+}
+
 FCRET OutOfMemory(VOID)
 {
+    if (DeferError(IDS_OUT_OF_MEMORY))
+        return FCRET_INVALID;
+    FlushOutput();
     ConResPuts(StdErr, IDS_OUT_OF_MEMORY);
     return FCRET_INVALID;
 }
 
 FCRET CannotRead(LPCWSTR file)
 {
+    if (DeferError(IDS_CANNOT_READ, file))
+        return FCRET_INVALID;
+    FlushOutput();
     ConResPrintf(StdErr, IDS_CANNOT_READ, file);
     return FCRET_INVALID;
 }
 
+FCRET CannotOpen(LPCWSTR file)
+{
+    if (DeferError(IDS_CANNOT_OPEN, file))
+        return FCRET_CANT_FIND;
+    FlushOutput();
+    ConResPrintf(StdErr, IDS_CANNOT_OPEN, file);
+    return FCRET_CANT_FIND;
+}
+
+// Prints what a worker thread has deferred, and frees it
+FCRET PrintDeferredOutput(DEFERRED_OUTPUT *output)
+{
+    FCRET ret = FCRET_IDENTICAL;
+    SIZE_T ichError = (output->pszError ? output->ichError : output->cch);
+
+    OutputCharsW(output->pch, ichError);
+    if (output->pszError)
+    {
+        FlushOutput();
+        ConPuts(StdErr, output->pszError);
+    }
+    OutputCharsW(&output->pch[ichError], output->cch - ichError);
+    FlushOutput();
+    if (output->bNoMemory)
+        ret = OutOfMemory();
+    FreeDeferredOutput(output);
+    return ret;
+}
+
+FCRET PathTooLong(LPCWSTR dir)
+{
+    FlushOutput();
+    ConResPrintf(StdErr, IDS_PATH_TOO_LONG, dir);
+    return FCRET_INVALID;
+}
+
 FCRET InvalidSwitch(VOID)
 {
+    FlushOutput();
     ConResPuts(StdErr, IDS_INVALID_SWITCH);
     return FCRET_INVALID;
 }
 
 FCRET ResyncFailed(VOID)
 {
+    if (DeferMessage(IDS_RESYNC_FAILED))
+        return FCRET_DIFFERENT;
+    FlushOutput();
     ConResPuts(StdOut, IDS_RESYNC_FAILED);
     return FCRET_DIFFERENT;
 }
 
 VOID PrintCaption(LPCWSTR file)
 {
-    ConPrintf(StdOut, L"***** %ls\n", file);
+    OutputStringW(L"***** ");
+    OutputStringW(file);
+    OutputStringW(L"\n");
 }
 
 VOID PrintEndOfDiff(VOID)
 {
-    ConPuts(StdOut, L"*****\n\n");
+    OutputStringW(L"*****\n\n");
 }
 
 VOID PrintDots(VOID)
 {
-    ConPuts(StdOut, L"...\n");
+    OutputStringW(L"...\n");
 }
 
-VOID PrintLineW(const FILECOMPARE *pFC, DWORD lineno, LPCWSTR psz)
+VOID PrintLineW(const FILECOMPARE *pFC, DWORD lineno, LPCWSTR pch, DWORD cch)
 {
     if (pFC->dwFlags & FLAG_N)
-        ConPrintf(StdOut, L"%5d:  %ls\n", lineno, psz);
-    else
-        ConPrintf(StdOut, L"%ls\n", psz);
+    {
+        OutputLineNumber(lineno);
+        OutputStringW(L":  ");
+    }
+    OutputCharsW(pch, cch);
+    OutputStringW(L"\n");
 }
-VOID PrintLineA(const FILECOMPARE *pFC, DWORD lineno, LPCSTR psz)
+VOID PrintLineA(const FILECOMPARE *pFC, DWORD lineno, LPCSTR pch, DWORD cch)
 {
     if (pFC->dwFlags & FLAG_N)
-        ConPrintf(StdOut, L"%5d:  %hs\n", lineno, psz);
-    else
-        ConPrintf(StdOut, L"%hs\n", psz);
+    {
+        OutputLineNumber(lineno);
+        OutputStringW(L":  ");
+    }
+    OutputCharsA(pch, cch);
+    OutputStringW(L"\n");
+}
+
+// Same as L"%08lX: %02X %02X\n" or L"%016I64X: %02X %02X\n"
+static VOID PrintBinaryDiff(ULONGLONG ib, BYTE b0, BYTE b1, BOOL bLarge)
+{
+    OutputHex(ib, (bLarge ? 16 : 8));
+    OutputStringW(L": ");
+    OutputHex(b0, 2);
+    OutputStringW(L" ");
+    OutputHex(b1, 2);
+    OutputStringW(L"\n");
+}
+
+// Collects the differing bytes into ranges for /RANGE and /MAXDIFF
+typedef struct BINREPORT
+{
+    const FILECOMPARE *pFC;
+    BOOL bLarge; // use 16 digits for offsets
+    BOOL fDifferent;
+    BOOL fStopped; // by /Q or /MAXDIFF
+    ULONGLONG ibRange; // the current range
+    ULONGLONG cbRange; // zero if no range
+    ULONGLONG cRanges;
+    BYTE ab0[MAX_RANGE_BYTES], ab1[MAX_RANGE_BYTES]; // the first bytes of the range
+} BINREPORT;
+
+static VOID InitBinaryReport(BINREPORT *report, const FILECOMPARE *pFC, BOOL bLarge)
+{
+    ZeroMemory(report, sizeof(*report));
+    report->pFC = pFC;
+    report->bLarge = bLarge;
+}
+
+// L"%08lX-%08lX: %lu bytes" and optionally L"  %02X ... | %02X ..."
+static VOID PrintBinaryRange(const BINREPORT *report)
+{
+    ULONGLONG ibLast = report->ibRange + report->cbRange - 1;
+    INT cDigits = ((report->bLarge || ibLast > MAXDWORD) ? 16 : 8);
+    DWORD ib, cb = (DWORD)min(report->cbRange, (ULONGLONG)report->pFC->nRangeBytes);
+    WCHAR sz[32];
+
+    OutputHex(report->ibRange, cDigits);
+    OutputStringW(L"-");
+    OutputHex(ibLast, cDigits);
+    StringCchPrintfW(sz, _countof(sz), L": %I64u bytes", report->cbRange);
+    OutputStringW(sz);
+    if (cb > 0)
+    {
+        OutputStringW(L" ");
+        for (ib = 0; ib < cb; ++ib)
+        {
+            OutputStringW(L" ");
+            OutputHex(report->ab0[ib], 2);
+        }
+        OutputStringW(L" |");
+        for (ib = 0; ib < cb; ++ib)
+        {
+            OutputStringW(L" ");
+            OutputHex(report->ab1[ib], 2);
+        }
+        if (report->cbRange > cb)
+            OutputStringW(L" ...");
+    }
+    OutputStringW(L"\n");
+}
+
+static VOID FlushBinaryReport(BINREPORT *report)
+{
+    if ((report->pFC->dwFlags & FLAG_RANGE) && report->cbRange > 0)
+        PrintBinaryRange(report);
+    report->cbRange = 0;
+}
+
+// Reports a differing byte. Returns FALSE if the scan should stop.
+static BOOL ReportBinaryDiff(BINREPORT *report, ULONGLONG ib, BYTE b0, BYTE b1)
+{
+    const FILECOMPARE *pFC = report->pFC;
+
+    report->fDifferent = TRUE;
+    if (pFC->dwFlags & FLAG_Q)
+    {
+        report->fStopped = TRUE;
+        return FALSE;
+    }
+
+    if (report->cbRange == 0 || ib != report->ibRange + report->cbRange)
+    {
+        // a new range begins
+        FlushBinaryReport(report);
+        if (pFC->nMaxDiff && report->cRanges >= pFC->nMaxDiff)
+        {
+            report->fStopped = TRUE;
+            return FALSE;
+        }
+        ++report->cRanges;
+        report->ibRange = ib;
+    }
+
+    if (report->cbRange < MAX_RANGE_BYTES)
+    {
+        report->ab0[report->cbRange] = b0;
+        report->ab1[report->cbRange] = b1;
+    }
+    ++report->cbRange;
+
+    if (!(pFC->dwFlags & FLAG_RANGE))
+        PrintBinaryDiff(ib, b0, b1, report->bLarge || ib > MAXDWORD);
+    return TRUE;
 }
 
 HANDLE DoOpenFileForInput(LPCWSTR file)
 {
     HANDLE hFile = CreateFileW(file, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
-    if (hFile == INVALID_HANDLE_VALUE)
+    if (hFile == INVALID_HANDLE_VALUE && !DeferError(IDS_CANNOT_OPEN, file))
     {
+        FlushOutput();
         ConResPrintf(StdErr, IDS_CANNOT_OPEN, file);
     }
     return hFile;
 }
 
+// Returns TRUE if the two handles refer to the same file (e.g. hard links)
+static BOOL IsSameFile(HANDLE hFile0, HANDLE hFile1)
+{
+    BY_HANDLE_FILE_INFORMATION info0, info1;
+    if (!GetFileInformationByHandle(hFile0, &info0) ||
+        !GetFileInformationByHandle(hFile1, &info1))
+    {
+        return FALSE;
+    }
+    return info0.dwVolumeSerialNumber == info1.dwVolumeSerialNumber &&
+           info0.nFileIndexHigh == info1.nFileIndexHigh &&
+           info0.nFileIndexLow == info1.nFileIndexLow;
+}
+
+// Decides the outcome from the file identity and sizes if possible, without mapping.
+// Returns TRUE if *pret is the final result.
+static BOOL
+PreCompare(FILECOMPARE *pFC, HANDLE hFile0, HANDLE hFile1,
+           LARGE_INTEGER *pcb0, LARGE_INTEGER *pcb1, BOOL bBinary, FCRET *pret)
+{
+    BOOL fQuiet = !!(pFC->dwFlags & FLAG_Q);
+
+    if (!GetFileSizeEx(hFile0, pcb0))
+    {
+        *pret = CannotRead(pFC->file[0]);
+        return TRUE;
+    }
+    if (!GetFileSizeEx(hFile1, pcb1))
+    {
+        *pret = CannotRead(pFC->file[1]);
+        return TRUE;
+    }
+
+    if (_wcsicmp(pFC->file[0], pFC->file[1]) == 0 ||
+        (pcb0->QuadPart == 0 && pcb1->QuadPart == 0) ||
+        (pcb0->QuadPart == pcb1->QuadPart && IsSameFile(hFile0, hFile1)))
+    {
+        *pret = (fQuiet ? FCRET_IDENTICAL : NoDifference());
+        return TRUE;
+    }
+
+    // The text engine may treat files of different sizes as identical
+    if (!bBinary || pcb0->QuadPart == pcb1->QuadPart)
+        return FALSE;
+
+    if (fQuiet)
+    {
+        *pret = FCRET_DIFFERENT;
+        return TRUE;
+    }
+    if (pcb0->QuadPart == 0)
+    {
+        *pret = LongerThan(pFC->file[1], pFC->file[0]);
+        return TRUE;
+    }
+    if (pcb1->QuadPart == 0)
+    {
+        *pret = LongerThan(pFC->file[0], pFC->file[1]);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static FCRET
+CompareMappings(FILECOMPARE *pFC, HANDLE hMapping0, HANDLE hMapping1,
+                const LARGE_INTEGER *pcbCommon, BINREPORT *report)
+{
+    FCRET ret = FCRET_IDENTICAL;
+    LPBYTE pb0, pb1;
+    LARGE_INTEGER ib;
+    DWORD cbView, ibView, cbSame;
+    LONGLONG t0;
+
+    for (ib.QuadPart = 0; ib.QuadPart < pcbCommon->QuadPart; )
+    {
+        cbView = (DWORD)min(pcbCommon->QuadPart - ib.QuadPart, MAX_VIEW_SIZE);
+        t0 = STATS_START();
+        pb0 = MapViewOfFile(hMapping0, FILE_MAP_READ, ib.HighPart, ib.LowPart, cbView);
+        pb1 = MapViewOfFile(hMapping1, FILE_MAP_READ, ib.HighPart, ib.LowPart, cbView);
+        STATS_STOP(qpcMap, t0);
+        STATS_ADD(cViews, 2);
+        STATS_ADD(cbMapped, 2 * cbView);
+        if (!pb0 || !pb1)
+        {
+            UnmapViewOfFile(pb0);
+            UnmapViewOfFile(pb1);
+            ret = OutOfMemory();
+            break;
+        }
+        for (ibView = 0; ibView < cbView; ++ib.QuadPart, ++ibView)
+        {
+            // skip the identical span at once
+            cbSame = (DWORD)FindMismatch(&pb0[ibView], &pb1[ibView], cbView - ibView);
+            ib.QuadPart += cbSame;
+            ibView += cbSame;
+            if (ibView >= cbView)
+                break;
+
+            if (!ReportBinaryDiff(report, ib.QuadPart, pb0[ibView], pb1[ibView]))
+            {
+                ++ib.QuadPart;
+                break;
+            }
+        }
+        UnmapViewOfFile(pb0);
+        UnmapViewOfFile(pb1);
+        if (report->fStopped)
+            break;
+    }
+    STATS_ADD(cbTouched, 2 * ib.QuadPart);
+    return ret;
+}
+
+#define PARALLEL_CHUNK_SIZE (16 * 1024 * 1024) // 16 MB
+#define MAX_CHUNK_DIFFS (64 * 1024) // records per chunk before the main thread takes over
+
+typedef struct BINDIFF
+{
+    DWORD ib; // offset in the chunk
+    BYTE b0, b1;
+} BINDIFF;
+
+typedef struct BINCHUNK
+{
+    ULONGLONG ib; // offset of the chunk
+    DWORD cb; // size of the chunk
+    DWORD ibNext; // where the scan resumes in the chunk
+    BINDIFF *pDiffs;
+    DWORD cDiffs;
+    FCRET ret;
+    HANDLE hDone; // event
+} BINCHUNK;
+
+typedef struct BINPOOL
+{
+    const FILECOMPARE *pFC;
+    HANDLE hMapping0, hMapping1;
+    ULONGLONG cChunks;
+    ULONGLONG cbCommon;
+    volatile LONGLONG iNextChunk;
+    volatile LONG fCancel;
+    HANDLE hSlots; // semaphore of free slots
+    INT cSlots;
+    BINCHUNK *chunks; // ring of cSlots
+} BINPOOL;
+
+// Scans a chunk from ibNext and stores up to MAX_CHUNK_DIFFS difference records
+static VOID ScanChunk(const BINPOOL *pool, BINCHUNK *chunk)
+{
+    LARGE_INTEGER ib;
+    LPBYTE pb0, pb1;
+    DWORD ibView, cbSame;
+    BOOL bQuiet = !!(pool->pFC->dwFlags & FLAG_Q);
+    LONGLONG t0;
+
+    chunk->cDiffs = 0;
+    ib.QuadPart = chunk->ib;
+    t0 = STATS_START();
+    pb0 = MapViewOfFile(pool->hMapping0, FILE_MAP_READ, ib.HighPart, ib.LowPart, chunk->cb);
+    pb1 = MapViewOfFile(pool->hMapping1, FILE_MAP_READ, ib.HighPart, ib.LowPart, chunk->cb);
+    STATS_STOP(qpcMap, t0);
+    STATS_ADD(cViews, 2);
+    STATS_ADD(cbMapped, 2 * chunk->cb);
+    if (!pb0 || !pb1)
+    {
+        UnmapViewOfFile(pb0);
+        UnmapViewOfFile(pb1);
+        chunk->ret = FCRET_INVALID;
+        return;
+    }
+
+    chunk->ret = FCRET_IDENTICAL;
+    for (ibView = chunk->ibNext; ibView < chunk->cb; ++ibView)
+    {
+        cbSame = (DWORD)FindMismatch(&pb0[ibView], &pb1[ibView], chunk->cb - ibView);
+        ibView += cbSame;
+        if (ibView >= chunk->cb)
+            break;
+        if (chunk->cDiffs >= MAX_CHUNK_DIFFS)
+            break;
+
+        chunk->ret = FCRET_DIFFERENT;
+        chunk->pDiffs[chunk->cDiffs].ib = ibView;
+        chunk->pDiffs[chunk->cDiffs].b0 = pb0[ibView];
+        chunk->pDiffs[chunk->cDiffs].b1 = pb1[ibView];
+        ++chunk->cDiffs;
+        if (bQuiet)
+        {
+            ibView = chunk->cb;
+            break;
+        }
+    }
+    chunk->ibNext = min(ibView, chunk->cb);
+
+    UnmapViewOfFile(pb0);
+    UnmapViewOfFile(pb1);
+}
+
+static DWORD WINAPI BinaryWorkerThreadProc(LPVOID arg)
+{
+    BINPOOL *pool = arg;
+    LONGLONG iChunk;
+    BINCHUNK *chunk;
+
+    for (;;)
+    {
+        WaitForSingleObject(pool->hSlots, INFINITE);
+        if (pool->fCancel)
+            break;
+        iChunk = InterlockedExchangeAdd64(&pool->iNextChunk, 1);
+        if ((ULONGLONG)iChunk >= pool->cChunks)
+            break;
+
+        // the main thread has already consumed the previous owner of this slot
+        chunk = &pool->chunks[iChunk % pool->cSlots];
+        chunk->ib = (ULONGLONG)iChunk * PARALLEL_CHUNK_SIZE;
+        chunk->cb = (DWORD)min(pool->cbCommon - chunk->ib, PARALLEL_CHUNK_SIZE);
+        chunk->ibNext = 0;
+        ScanChunk(pool, chunk);
+        SetEvent(chunk->hDone);
+    }
+    return 0;
+}
+
+// Compares the common range on a worker pool and prints the records in offset order
+static FCRET
+CompareMappingsParallel(FILECOMPARE *pFC, HANDLE hMapping0, HANDLE hMapping1,
+                        const LARGE_INTEGER *pcbCommon, BINREPORT *report)
+{
+    FCRET ret = FCRET_IDENTICAL;
+    BINPOOL pool = { .pFC = pFC, .hMapping0 = hMapping0, .hMapping1 = hMapping1 };
+    HANDLE hThreads[MAX_THREADS];
+    INT cThreads = 0, iSlot;
+    ULONGLONG iChunk;
+    BINCHUNK *chunk;
+    DWORD iDiff;
+
+    pool.cbCommon = pcbCommon->QuadPart;
+    pool.cChunks = (pool.cbCommon + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE;
+    pool.cSlots = 2 * pFC->nThreads;
+    pool.chunks = calloc(pool.cSlots, sizeof(BINCHUNK));
+    pool.hSlots = CreateSemaphoreW(NULL, pool.cSlots, MAXLONG, NULL);
+    if (!pool.chunks || !pool.hSlots)
+    {
+        ret = OutOfMemory();
+        goto cleanup;
+    }
+    for (iSlot = 0; iSlot < pool.cSlots; ++iSlot)
+    {
+        pool.chunks[iSlot].pDiffs = malloc(MAX_CHUNK_DIFFS * sizeof(BINDIFF));
+        pool.chunks[iSlot].hDone = CreateEventW(NULL, FALSE, FALSE, NULL);
+        if (!pool.chunks[iSlot].pDiffs || !pool.chunks[iSlot].hDone)
+        {
+            ret = OutOfMemory();
+            goto cleanup;
+        }
+    }
+
+    for (cThreads = 0; cThreads < pFC->nThreads; ++cThreads)
+    {
+        hThreads[cThreads] = CreateThread(NULL, 0, BinaryWorkerThreadProc, &pool, 0, NULL);
+        if (!hThreads[cThreads])
+            break;
+    }
+    if (cThreads == 0)
+    {
+        ret = OutOfMemory();
+        goto cleanup;
+    }
+
+    // merge the chunks in order
+    for (iChunk = 0; iChunk < pool.cChunks; ++iChunk)
+    {
+        chunk = &pool.chunks[iChunk % pool.cSlots];
+        WaitForSingleObject(chunk->hDone, INFINITE);
+        for (;;)
+        {
+            if (chunk->ret == FCRET_INVALID)
+            {
+                ret = OutOfMemory();
+                break;
+            }
+            for (iDiff = 0; iDiff < chunk->cDiffs; ++iDiff)
+            {
+                if (!ReportBinaryDiff(report, chunk->ib + chunk->pDiffs[iDiff].ib,
+                                      chunk->pDiffs[iDiff].b0, chunk->pDiffs[iDiff].b1))
+                {
+                    break;
+                }
+            }
+            if (report->fStopped || chunk->ibNext >= chunk->cb)
+                break;
+            // too many records; continue the rest of the chunk here
+            ScanChunk(&pool, chunk);
+        }
+        STATS_ADD(cbTouched, 2 * (ULONGLONG)chunk->ibNext);
+        if (ret != FCRET_IDENTICAL || report->fStopped)
+            break;
+        ReleaseSemaphore(pool.hSlots, 1, NULL);
+    }
+
+cleanup:
+    if (cThreads > 0)
+    {
+        // wake up the workers and let them quit
+        pool.fCancel = TRUE;
+        ReleaseSemaphore(pool.hSlots, cThreads, NULL);
+        WaitForMultipleObjects(cThreads, hThreads, TRUE, INFINITE);
+        while (cThreads-- > 0)
+            CloseHandle(hThreads[cThreads]);
+    }
+    if (pool.chunks)
+    {
+        for (iSlot = 0; iSlot < pool.cSlots; ++iSlot)
+        {
+            free(pool.chunks[iSlot].pDiffs);
+            CloseHandle(pool.chunks[iSlot].hDone);
+        }
+        free(pool.chunks);
+    }
+    CloseHandle(pool.hSlots);
+    return ret;
+}
+
+// The sizes of streams are unknown in advance, so the offset width follows each offset
+static FCRET StreamBinaryCompare(FILECOMPARE *pFC, STREAM *stream0, STREAM *stream1)
+{
+    const BYTE *pb0 = NULL, *pb1 = NULL;
+    DWORD cb0 = 0, cb1 = 0, cb, ib, cbSame;
+    ULONGLONG ibTotal = 0;
+    BINREPORT report;
+
+    InitBinaryReport(&report, pFC, FALSE);
+
+    for (;;)
+    {
+        if (cb0 == 0 && !StreamRead(stream0, &pb0, &cb0))
+            return CannotRead(pFC->file[0]);
+        if (cb1 == 0 && !StreamRead(stream1, &pb1, &cb1))
+            return CannotRead(pFC->file[1]);
+        if (cb0 == 0 || cb1 == 0)
+            break;
+
+        cb = min(cb0, cb1);
+        for (ib = 0; ib < cb; ++ib, ++ibTotal)
+        {
+            cbSame = (DWORD)FindMismatch(&pb0[ib], &pb1[ib], cb - ib);
+            ib += cbSame;
+            ibTotal += cbSame;
+            if (ib >= cb)
+                break;
+
+            if (!ReportBinaryDiff(&report, ibTotal, pb0[ib], pb1[ib]))
+                break;
+        }
+        if (report.fStopped)
+            break;
+        pb0 += cb;
+        pb1 += cb;
+        cb0 -= cb;
+        cb1 -= cb;
+    }
+
+    FlushBinaryReport(&report);
+    if (pFC->dwFlags & FLAG_Q)
+        return ((report.fDifferent || cb0 || cb1) ? FCRET_DIFFERENT : FCRET_IDENTICAL);
+    // the rest is unknown if the scan has stopped
+    if (report.fStopped)
+        return Different(pFC->file[0], pFC->file[1]);
+    if (cb1 > 0)
+        return LongerThan(pFC->file[1], pFC->file[0]);
+    if (cb0 > 0)
+        return LongerThan(pFC->file[0], pFC->file[1]);
+    if (report.fDifferent)
+        return Different(pFC->file[0], pFC->file[1]);
+    return NoDifference();
+}
+
+#define DETECT_SIZE (64 * 1024) // the head of a file to guess its encoding
+
+// The files are compared as UNICODE unless both of them are ANSI
+static FCRET
+DoTextCompare(FILECOMPARE *pFC, HANDLE *phMapping0, const LARGE_INTEGER *pcb0,
+              HANDLE *phMapping1, const LARGE_INTEGER *pcb1)
+{
+    if (pFC->encoding[0] == ENCODING_ANSI && pFC->encoding[1] == ENCODING_ANSI)
+        return TextCompareA(pFC, phMapping0, pcb0, phMapping1, pcb1);
+    return TextCompareW(pFC, phMapping0, pcb0, phMapping1, pcb1);
+}
+
+static BOOL DetectStreamEncoding(FILECOMPARE *pFC, INT i, STREAM *stream)
+{
+    const BYTE *pb;
+    DWORD cb;
+
+    if (!StreamPeek(stream, &pb, &cb))
+        return FALSE;
+    pFC->encoding[i] = DetectEncoding(pFC->dwFlags, pb, min(cb, DETECT_SIZE), &pFC->cbBOM[i]);
+    return TRUE;
+}
+
+static VOID DetectMappingEncoding(FILECOMPARE *pFC, INT i, HANDLE hMapping, const LARGE_INTEGER *pcb)
+{
+    DWORD cb = (DWORD)min(pcb->QuadPart, DETECT_SIZE);
+    const BYTE *pb = NULL;
+    LONGLONG t0;
+
+    if (hMapping && cb > 0)
+    {
+        t0 = STATS_START();
+        pb = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, cb);
+        STATS_STOP(qpcMap, t0);
+        STATS_ADD(cViews, 1);
+        STATS_ADD(cbMapped, cb);
+    }
+    pFC->encoding[i] = DetectEncoding(pFC->dwFlags, pb, (pb ? cb : 0), &pFC->cbBOM[i]);
+    if (pb)
+        UnmapViewOfFile((LPVOID)pb);
+}
+
+// L"-" (the standard input) and /STREAM read the files sequentially instead of mapping
+static __inline BOOL IsStreamInput(const FILECOMPARE *pFC)
+{
+    return (pFC->dwFlags & FLAG_STREAM) ||
+           wcscmp(pFC->file[0], L"-") == 0 || wcscmp(pFC->file[1], L"-") == 0;
+}
+
+static FCRET StreamFileCompare(FILECOMPARE *pFC, BOOL bBinary)
+{
+    FCRET ret;
+    STREAM stream0, stream1;
+    HANDLE hMapping0 = NULL, hMapping1 = NULL;
+    LARGE_INTEGER cb0 = { .QuadPart = 0 }, cb1 = { .QuadPart = 0 };
+
+    if (_wcsicmp(pFC->file[0], pFC->file[1]) == 0)
+        return ((pFC->dwFlags & FLAG_Q) ? FCRET_IDENTICAL : NoDifference());
+
+    if (!StreamOpen(&stream0, pFC->file[0]))
+        return FCRET_CANT_FIND;
+    if (!StreamOpen(&stream1, pFC->file[1]))
+    {
+        StreamClose(&stream0);
+        return FCRET_CANT_FIND;
+    }
+
+    if (bBinary)
+    {
+        ret = StreamBinaryCompare(pFC, &stream0, &stream1);
+    }
+    else
+    {
+        pFC->stream[0] = &stream0;
+        pFC->stream[1] = &stream1;
+        if (!DetectStreamEncoding(pFC, 0, &stream0))
+            ret = CannotRead(pFC->file[0]);
+        else if (!DetectStreamEncoding(pFC, 1, &stream1))
+            ret = CannotRead(pFC->file[1]);
+        else
+            ret = DoTextCompare(pFC, &hMapping0, &cb0, &hMapping1, &cb1);
+        pFC->stream[0] = pFC->stream[1] = NULL;
+    }
+
+    STATS_ADD(cbTouched, stream0.cbTotal + stream1.cbTotal);
+    StreamClose(&stream0);
+    StreamClose(&stream1);
+    return ret;
+}
+
 static FCRET BinaryFileCompare(FILECOMPARE *pFC)
 {
     FCRET ret;
     HANDLE hFile0, hFile1, hMapping0 = NULL, hMapping1 = NULL;
-    LPBYTE pb0 = NULL, pb1 = NULL;
-    LARGE_INTEGER ib, cb0, cb1, cbCommon;
-    DWORD cbView, ibView;
-    BOOL fDifferent = FALSE;
+    LARGE_INTEGER cb0, cb1, cbCommon;
+    BINREPORT report;
+
+    if (IsStreamInput(pFC))
+        return StreamFileCompare(pFC, TRUE);
 
     hFile0 = DoOpenFileForInput(pFC->file[0]);
     if (hFile0 == INVALID_HANDLE_VALUE)
@@ -146,22 +1086,10 @@ static FCRET BinaryFileCompare(FILECOMPARE *pFC)
 
     do
     {
-        if (_wcsicmp(pFC->file[0], pFC->file[1]) == 0)
-        {
-            ret = NoDifference();
+        if (PreCompare(pFC, hFile0, hFile1, &cb0, &cb1, TRUE, &ret))
             break;
-        }
-        if (!GetFileSizeEx(hFile0, &cb0))
-        {
-            ret = CannotRead(pFC->file[0]);
-            break;
-        }
-        if (!GetFileSizeEx(hFile1, &cb1))
-        {
-            ret = CannotRead(pFC->file[1]);
-            break;
-        }
         cbCommon.QuadPart = min(cb0.QuadPart, cb1.QuadPart);
+        InitBinaryReport(&report, pFC, cbCommon.QuadPart > MAXDWORD);
         if (cbCommon.QuadPart > 0)
         {
             hMapping0 = CreateFileMappingW(hFile0, NULL, PAGE_READONLY,
@@ -179,54 +1107,31 @@ static FCRET BinaryFileCompare(FILECOMPARE *pFC)
                 break;
             }
 
-            ret = FCRET_IDENTICAL;
-            for (ib.QuadPart = 0; ib.QuadPart < cbCommon.QuadPart; )
-            {
-                cbView = (DWORD)min(cbCommon.QuadPart - ib.QuadPart, MAX_VIEW_SIZE);
-                pb0 = MapViewOfFile(hMapping0, FILE_MAP_READ, ib.HighPart, ib.LowPart, cbView);
-                pb1 = MapViewOfFile(hMapping1, FILE_MAP_READ, ib.HighPart, ib.LowPart, cbView);
-                if (!pb0 || !pb1)
-                {
-                    ret = OutOfMemory();
-                    break;
-                }
-                for (ibView = 0; ibView < cbView; ++ib.QuadPart, ++ibView)
-                {
-                    if (pb0[ibView] == pb1[ibView])
-                        continue;
-
-                    fDifferent = TRUE;
-                    if (cbCommon.QuadPart > MAXDWORD)
-                    {
-                        ConPrintf(StdOut, L"%016I64X: %02X %02X\n", ib.QuadPart,
-                                  pb0[ibView], pb1[ibView]);
-                    }
-                    else
-                    {
-                        ConPrintf(StdOut, L"%08lX: %02X %02X\n", ib.LowPart,
-                                  pb0[ibView], pb1[ibView]);
-                    }
-                }
-                UnmapViewOfFile(pb0);
-                UnmapViewOfFile(pb1);
-                pb0 = pb1 = NULL;
-            }
+            if (pFC->nThreads > 1 && cbCommon.QuadPart > PARALLEL_CHUNK_SIZE)
+                ret = CompareMappingsParallel(pFC, hMapping0, hMapping1, &cbCommon, &report);
+            else
+                ret = CompareMappings(pFC, hMapping0, hMapping1, &cbCommon, &report);
             if (ret != FCRET_IDENTICAL)
                 break;
+            FlushBinaryReport(&report);
+        }
+
+        if (pFC->dwFlags & FLAG_Q)
+        {
+            ret = (report.fDifferent ? FCRET_DIFFERENT : FCRET_IDENTICAL);
+            break;
         }
 
         if (cb0.QuadPart < cb1.QuadPart)
             ret = LongerThan(pFC->file[1], pFC->file[0]);
         else if (cb0.QuadPart > cb1.QuadPart)
             ret = LongerThan(pFC->file[0], pFC->file[1]);
-        else if (fDifferent)
+        else if (report.fDifferent)
             ret = Different(pFC->file[0], pFC->file[1]);
         else
             ret = NoDifference();
     } while (0);
 
-    UnmapViewOfFile(pb0);
-    UnmapViewOfFile(pb1);
     CloseHandle(hMapping0);
     CloseHandle(hMapping1);
     CloseHandle(hFile0);
@@ -239,7 +1144,9 @@ static FCRET TextFileCompare(FILECOMPARE *pFC)
     FCRET ret;
     HANDLE hFile0, hFile1, hMapping0 = NULL, hMapping1 = NULL;
     LARGE_INTEGER cb0, cb1;
-    BOOL fUnicode = !!(pFC->dwFlags & FLAG_U);
+
+    if (IsStreamInput(pFC))
+        return StreamFileCompare(pFC, FALSE);
 
     hFile0 = DoOpenFileForInput(pFC->file[0]);
     if (hFile0 == INVALID_HANDLE_VALUE)
@@ -253,26 +1160,8 @@ static FCRET TextFileCompare(FILECOMPARE *pFC)
 
     do
     {
-        if (_wcsicmp(pFC->file[0], pFC->file[1]) == 0)
-        {
-            ret = NoDifference();
-            break;
-        }
-        if (!GetFileSizeEx(hFile0, &cb0))
-        {
-            ret = CannotRead(pFC->file[0]);
-            break;
-        }
-        if (!GetFileSizeEx(hFile1, &cb1))
-        {
-            ret = CannotRead(pFC->file[1]);
-            break;
-        }
-        if (cb0.QuadPart == 0 && cb1.QuadPart == 0)
-        {
-            ret = NoDifference();
+        if (PreCompare(pFC, hFile0, hFile1, &cb0, &cb1, FALSE, &ret))
             break;
-        }
         if (cb0.QuadPart > 0)
         {
             hMapping0 = CreateFileMappingW(hFile0, NULL, PAGE_READONLY,
@@ -293,10 +1182,9 @@ static FCRET TextFileCompare(FILECOMPARE *pFC)
                 break;
             }
         }
-        if (fUnicode)
-            ret = TextCompareW(pFC, &hMapping0, &cb0, &hMapping1, &cb1);
-        else
-            ret = TextCompareA(pFC, &hMapping0, &cb0, &hMapping1, &cb1);
+        DetectMappingEncoding(pFC, 0, hMapping0, &cb0);
+        DetectMappingEncoding(pFC, 1, hMapping1, &cb1);
+        ret = DoTextCompare(pFC, &hMapping0, &cb0, &hMapping1, &cb1);
     } while (0);
 
     CloseHandle(hMapping0);
@@ -306,6 +1194,88 @@ static FCRET TextFileCompare(FILECOMPARE *pFC)
     return ret;
 }
 
+// The digest of the fixed side of a wildcard comparison is computed only once
+static FCRET GetFileDigest(FILECOMPARE *pFC, INT i)
+{
+    FCRET ret = FCRET_IDENTICAL;
+    STREAM stream;
+    DIGEST_STATE state;
+    CACHE_ENTRY entry;
+    const BYTE *pb;
+    DWORD cb;
+
+    if (pFC->bDigest[i])
+        return FCRET_IDENTICAL;
+
+    // the file is not read if it is unchanged since the last run
+    ZeroMemory(&entry, sizeof(entry));
+    if (pFC->cache && wcscmp(pFC->file[i], L"-") != 0 &&
+        CacheLookup(pFC->cache, pFC->file[i], &entry))
+    {
+        pFC->digest[i] = entry.digest;
+        pFC->bDigest[i] = TRUE;
+        return FCRET_IDENTICAL;
+    }
+
+    if (!StreamOpen(&stream, pFC->file[i]))
+        return FCRET_CANT_FIND;
+
+    DigestInit(&state);
+    for (;;)
+    {
+        if (!StreamRead(&stream, &pb, &cb))
+        {
+            ret = CannotRead(pFC->file[i]);
+            break;
+        }
+        if (cb == 0)
+            break;
+        DigestUpdate(&state, pb, cb);
+    }
+    STATS_ADD(cbTouched, stream.cbTotal);
+    StreamClose(&stream);
+
+    if (ret == FCRET_IDENTICAL)
+    {
+        DigestFinal(&state, &pFC->digest[i]);
+        pFC->bDigest[i] = TRUE;
+        if (pFC->cache)
+        {
+            entry.digest = pFC->digest[i];
+            CacheStore(pFC->cache, &entry);
+        }
+    }
+    return ret;
+}
+
+static VOID PrintDigest(const DIGEST *digest, LPCWSTR file)
+{
+    OutputHex(digest->hi, 16);
+    OutputHex(digest->lo, 16);
+    OutputStringW(L"  ");
+    OutputStringW(file);
+    OutputStringW(L"\n");
+}
+
+static FCRET DigestFileCompare(FILECOMPARE *pFC)
+{
+    FCRET ret;
+    INT i;
+
+    for (i = 0; i < 2; ++i)
+    {
+        ret = GetFileDigest(pFC, i);
+        if (ret != FCRET_IDENTICAL)
+            return ret;
+        if ((pFC->dwFlags & (FLAG_DIGEST_PRINT | FLAG_Q)) == FLAG_DIGEST_PRINT)
+            PrintDigest(&pFC->digest[i], pFC->file[i]);
+    }
+
+    if (pFC->digest[0].lo == pFC->digest[1].lo && pFC->digest[0].hi == pFC->digest[1].hi)
+        return ((pFC->dwFlags & FLAG_Q) ? FCRET_IDENTICAL : NoDifference());
+    return ((pFC->dwFlags & FLAG_Q) ? FCRET_DIFFERENT : Different(pFC->file[0], pFC->file[1]));
+}
+
 static BOOL IsBinaryExt(LPCWSTR filename)
 {
     // Don't change this array. This is by design.
@@ -337,13 +1307,37 @@ static BOOL IsBinaryExt(LPCWSTR filename)
     return FALSE;
 }
 
-static FCRET FileCompare(FILECOMPARE *pFC)
+VOID BeginFileCompare(const FILECOMPARE *pFC)
+{
+    if (pFC->dwFlags & FLAG_Q)
+    {
+        FlushOutput();
+    }
+    else if (!DeferMessage(IDS_COMPARING, pFC->file[0], pFC->file[1]))
+    {
+        FlushOutput();
+        ConResPrintf(StdOut, IDS_COMPARING, pFC->file[0], pFC->file[1]);
+    }
+}
+
+VOID EndFileCompare(const FILECOMPARE *pFC)
+{
+    if (!(pFC->dwFlags & FLAG_Q))
+        OutputStringW(L"\n");
+    FlushOutput();
+}
+
+FCRET FileCompare(FILECOMPARE *pFC)
 {
     FCRET ret;
-    ConResPrintf(StdOut, IDS_COMPARING, pFC->file[0], pFC->file[1]);
+    BeginFileCompare(pFC);
 
-    if (!(pFC->dwFlags & FLAG_L) &&
-        ((pFC->dwFlags & FLAG_B) || IsBinaryExt(pFC->file[0]) || IsBinaryExt(pFC->file[1])))
+    if (pFC->dwFlags & FLAG_DIGEST)
+    {
+        ret = DigestFileCompare(pFC);
+    }
+    else if (!(pFC->dwFlags & FLAG_L) &&
+             ((pFC->dwFlags & FLAG_B) || IsBinaryExt(pFC->file[0]) || IsBinaryExt(pFC->file[1])))
     {
         ret = BinaryFileCompare(pFC);
     }
@@ -352,7 +1346,7 @@ static FCRET FileCompare(FILECOMPARE *pFC)
         ret = TextFileCompare(pFC);
     }
 
-    ConPuts(StdOut, L"\n");
+    EndFileCompare(pFC);
     return ret;
 }
 
@@ -389,6 +1383,7 @@ static FCRET WildcardFileCompareOneSide(FILECOMPARE *pFC, BOOL bWildRight)
             continue;
         PathRemoveFileSpecW(szPath);
         PathAppendW(szPath, find.cFileName);
+        fc.bDigest[bWildRight] = FALSE;
         switch (FileCompare(&fc))
         {
             case FCRET_IDENTICAL:
@@ -453,6 +1448,7 @@ static FCRET WildcardFileCompareBoth(FILECOMPARE *pFC)
         PathRemoveFileSpecW(szPath1);
         PathAppendW(szPath0, find0.cFileName);
         PathAppendW(szPath1, find1.cFileName);
+        fc.bDigest[0] = fc.bDigest[1] = FALSE;
         switch (FileCompare(&fc))
         {
             case FCRET_IDENTICAL:
@@ -500,7 +1496,7 @@ quit:
     return ret;
 }
 
-static FCRET WildcardFileCompare(FILECOMPARE *pFC)
+FCRET WildcardFileCompare(FILECOMPARE *pFC)
 {
     BOOL fWild0, fWild1;
 
@@ -516,6 +1512,9 @@ static FCRET WildcardFileCompare(FILECOMPARE *pFC)
         return FCRET_INVALID;
     }
 
+    if (pFC->dwFlags & FLAG_R)
+        return TreeFileCompare(pFC);
+
     fWild0 = HasWildcard(pFC->file[0]);
     fWild1 = HasWildcard(pFC->file[1]);
     if (fWild0 && fWild1)
@@ -528,12 +1527,21 @@ static FCRET WildcardFileCompare(FILECOMPARE *pFC)
     return FileCompare(pFC);
 }
 
+// fc_bench links this file without the entry points
+#ifndef FC_BENCH
 int wmain(int argc, WCHAR **argv)
 {
-    FILECOMPARE fc = { .dwFlags = 0, .n = 100, .nnnn = 2 };
+    FILECOMPARE fc = { .dwFlags = 0, .n = 100, .nnnn = 2, .nThreads = 0 };
     PWCHAR endptr;
+    LPCWSTR pszCache = NULL;
+    CACHE cache;
+    STATS stats;
+    LONGLONG t0;
+    FCRET ret;
     INT i;
 
+    ZeroMemory(&stats, sizeof(stats));
+
     /* Initialize the Console Standard Streams */
     ConInitStdStreams();
 
@@ -552,13 +1560,64 @@ int wmain(int argc, WCHAR **argv)
         switch (towupper(argv[i][1]))
         {
             case L'A':
-                fc.dwFlags |= FLAG_A;
+                if (_wcsicmp(argv[i], L"/ALGO:FC") == 0)
+                    fc.nAlgo = ALGO_FC;
+                else if (_wcsicmp(argv[i], L"/ALGO:MYERS") == 0)
+                    fc.nAlgo = ALGO_MYERS;
+                else if (_wcsicmp(argv[i], L"/ALGO:HISTOGRAM") == 0)
+                    fc.nAlgo = ALGO_HISTOGRAM;
+                else if (_wcsnicmp(argv[i], L"/ALGO", 5) == 0)
+                    return InvalidSwitch();
+                else
+                    fc.dwFlags |= FLAG_A;
                 break;
             case L'B':
                 fc.dwFlags |= FLAG_B;
                 break;
             case L'C':
-                fc.dwFlags |= FLAG_C;
+                if (_wcsnicmp(argv[i], L"/CACHE:", 7) == 0 && argv[i][7])
+                {
+                    // only the digests are cached
+                    fc.dwFlags |= FLAG_DIGEST;
+                    pszCache = &argv[i][7];
+                }
+                else if (_wcsnicmp(argv[i], L"/CACHE", 6) == 0)
+                {
+                    return InvalidSwitch();
+                }
+                else
+                {
+                    fc.dwFlags |= FLAG_C;
+                }
+                break;
+            case L'D':
+                if (_wcsicmp(argv[i], L"/DIGEST") == 0)
+                    fc.dwFlags |= FLAG_DIGEST;
+                else if (_wcsicmp(argv[i], L"/DIGEST:PRINT") == 0)
+                    fc.dwFlags |= FLAG_DIGEST | FLAG_DIGEST_PRINT;
+                else
+                    return InvalidSwitch();
+                break;
+            case L'J':
+                if (_wcsicmp(argv[i], L"/J") == 0)
+                {
+                    SYSTEM_INFO info;
+                    GetSystemInfo(&info);
+                    fc.nThreads = min(info.dwNumberOfProcessors, MAX_THREADS);
+                }
+                else if (argv[i][2] == L':' && iswdigit(argv[i][3]))
+                {
+                    fc.nThreads = wcstoul(&argv[i][3], &endptr, 10);
+                    if (endptr == NULL || *endptr != 0 ||
+                        fc.nThreads < 1 || fc.nThreads > MAX_THREADS)
+                    {
+                        return InvalidSwitch();
+                    }
+                }
+                else
+                {
+                    return InvalidSwitch();
+                }
                 break;
             case L'L':
                 if (_wcsicmp(argv[i], L"/L") == 0)
@@ -580,6 +1639,18 @@ int wmain(int argc, WCHAR **argv)
                     }
                 }
                 break;
+            case L'M':
+                if (_wcsnicmp(argv[i], L"/MAXDIFF:", 9) == 0 && iswdigit(argv[i][9]))
+                {
+                    fc.nMaxDiff = wcstoul(&argv[i][9], &endptr, 10);
+                    if (endptr == NULL || *endptr != 0)
+                        return InvalidSwitch();
+                }
+                else
+                {
+                    return InvalidSwitch();
+                }
+                break;
             case L'N':
                 fc.dwFlags |= FLAG_N;
                 break;
@@ -588,6 +1659,48 @@ int wmain(int argc, WCHAR **argv)
                 {
                     fc.dwFlags |= FLAG_OFFLINE;
                 }
+                else if (_wcsicmp(argv[i], L"/ORD") == 0)
+                {
+                    fc.dwFlags |= FLAG_ORD;
+                }
+                break;
+            case L'R':
+                if (_wcsicmp(argv[i], L"/R") == 0)
+                {
+                    fc.dwFlags |= FLAG_R;
+                }
+                else if (_wcsicmp(argv[i], L"/RANGE") == 0)
+                {
+                    fc.dwFlags |= FLAG_RANGE;
+                }
+                else if (_wcsnicmp(argv[i], L"/RANGE:", 7) == 0 && iswdigit(argv[i][7]))
+                {
+                    fc.dwFlags |= FLAG_RANGE;
+                    fc.nRangeBytes = wcstoul(&argv[i][7], &endptr, 10);
+                    if (endptr == NULL || *endptr != 0 || fc.nRangeBytes > MAX_RANGE_BYTES)
+                        return InvalidSwitch();
+                }
+                else
+                {
+                    return InvalidSwitch();
+                }
+                break;
+            case L'S':
+                if (_wcsicmp(argv[i], L"/STREAM") == 0)
+                {
+                    fc.dwFlags |= FLAG_STREAM;
+                }
+                else if (_wcsicmp(argv[i], L"/STATS") == 0)
+                {
+                    g_pStats = &stats;
+                }
+                else if (_wcsicmp(argv[i], L"/STATS:JSON") == 0)
+                {
+                    g_pStats = &stats;
+                    stats.bJSON = TRUE;
+                }
+                else
+                    return InvalidSwitch();
                 break;
             case L'T':
                 fc.dwFlags |= FLAG_T;
@@ -605,6 +1718,9 @@ int wmain(int argc, WCHAR **argv)
                     return InvalidSwitch();
                 fc.dwFlags |= FLAG_nnnn;
                 break;
+            case L'Q':
+                fc.dwFlags |= FLAG_Q;
+                break;
             case L'?':
                 fc.dwFlags |= FLAG_HELP;
                 break;
@@ -612,7 +1728,33 @@ int wmain(int argc, WCHAR **argv)
                 return InvalidSwitch();
         }
     }
-    return WildcardFileCompare(&fc);
+
+    t0 = STATS_START();
+    if (!pszCache)
+    {
+        ret = WildcardFileCompare(&fc);
+    }
+    else
+    {
+        CacheLoad(&cache, pszCache);
+        fc.cache = &cache;
+        ret = WildcardFileCompare(&fc);
+        if (!CacheSave(&cache))
+        {
+            FlushOutput();
+            ConResPrintf(StdErr, IDS_CANNOT_WRITE, pszCache);
+        }
+        CacheFree(&cache);
+    }
+
+    if (g_pStats)
+    {
+        FlushOutput();
+        STATS_STOP(qpcTotal, t0);
+        PrintStats(g_pStats);
+        g_pStats = NULL;
+    }
+    return ret;
 }
 
 #ifndef __REACTOS__
@@ -625,3 +1767,4 @@ int main(int argc, char **argv)
     return ret;
 }
 #endif
+#endif // ndef FC_BENCH
@@ -16,7 +16,6 @@
 #else
     #include <windows.h>
 #endif
-#include <wine/list.h>
 #include "resource.h"
 
 // See also: https://stackoverflow.com/questions/33125766/compare-files-with-a-cmd
@@ -29,22 +28,54 @@ typedef enum FCRET // return code of FC command
     FCRET_NO_MORE_DATA = 3 // (extension)
 } FCRET;
 
-typedef struct NODE_W
+#define LINE_CHUNK_SHIFT 14
+#define LINE_CHUNK_SIZE (1 << LINE_CHUNK_SHIFT) // lines
+#define LINE_CHUNK_MASK (LINE_CHUNK_SIZE - 1)
+
+// Parallel arrays of the line table. The text is LPCSTR or LPCWSTR.
+typedef struct LINE_CHUNK
+{
+    DWORD id[LINE_CHUNK_SIZE]; // the class of the equal lines
+    DWORD cch[LINE_CHUNK_SIZE];
+    LPCVOID pch[LINE_CHUNK_SIZE]; // as it is in the file
+} LINE_CHUNK;
+
+// The lines of a file. Line #i is at index (i - 1). The chunks before
+// iFirst are released (NULL) as the comparison goes on.
+typedef struct LINES
+{
+    LINE_CHUNK **chunks;
+    DWORD cChunks, cChunkSlots;
+    DWORD cLines;
+    DWORD iFirst; // the lines before iFirst are released
+} LINES;
+
+// The classes of the equal lines of both files by the hashes
+typedef struct INTERN_SLOT
 {
-    struct list entry;
-    LPWSTR pszLine;
-    LPWSTR pszComp; // compressed
-    DWORD lineno;
-    DWORD hash;
-} NODE_W;
-typedef struct NODE_A
+    DWORD hash; // the 64-bit hash folded
+    DWORD id; // zero if the slot is empty
+} INTERN_SLOT;
+
+#define NO_LINE 0xFFFFFFFF
+
+typedef struct INTERN_CLASS
 {
-    struct list entry;
-    LPSTR pszLine;
-    LPSTR pszComp; // compressed
-    DWORD lineno;
-    DWORD hash;
-} NODE_A;
+    DWORD iLast[2]; // the last line of the class in each file, or NO_LINE
+    DWORD hash; // the next free ID if the class is free
+    const BYTE *pbKey; // the sort key for /C, made on demand
+} INTERN_CLASS;
+
+typedef struct INTERN
+{
+    INTERN_SLOT *slots;
+    DWORD cSlots;
+    INTERN_CLASS *classes; // indexed by the IDs
+    DWORD cClasses, cClassSlots;
+    DWORD cUsed; // # of the classes in use
+    DWORD idFree; // the list of the free IDs
+    DWORD iNext[2]; // the line of the other file likely to match the next line
+} INTERN;
 
 #define FLAG_A (1 << 0) // abbreviation
 #define FLAG_B (1 << 1) // binary
@@ -58,16 +89,201 @@ typedef struct NODE_A
 #define FLAG_W (1 << 9) // compress white space
 #define FLAG_nnnn (1 << 10) // ???
 #define FLAG_HELP (1 << 11) // show usage
+#define FLAG_Q (1 << 12) // quiet (stop at the first difference)
+#define FLAG_STREAM (1 << 13) // read sequentially instead of mapping
+#define FLAG_RANGE (1 << 14) // report binary differences as ranges
+#define FLAG_DIGEST (1 << 15) // compare the digests of the contents
+#define FLAG_DIGEST_PRINT (1 << 16) // print the digests
+#define FLAG_R (1 << 17) // compare directory trees recursively
+#define FLAG_ORD (1 << 18) // compare lines ordinally
+
+typedef enum ALGO // text comparison engine (/ALGO:...)
+{
+    ALGO_FC = 0, // resync heuristic of FC
+    ALGO_MYERS, // minimal edit script
+    ALGO_HISTOGRAM // anchored on the rare lines
+} ALGO;
+
+typedef enum ENCODING // of a text file
+{
+    ENCODING_ANSI = 0, // the code page of the system
+    ENCODING_UTF8,
+    ENCODING_UTF16LE,
+    ENCODING_UTF16BE
+} ENCODING;
+
+#define STREAM_BUFFER_SIZE (4 * 1024 * 1024) // 4 MB
+#define STREAM_BUFFERS 3
+#define STREAM_CANCEL_RETRY 50 // ms between the cancels of a blocked read
+
+typedef struct STREAM
+{
+    HANDLE hFile;
+    BOOL bOwnHandle; // FALSE for the standard input
+    HANDLE hThread; // reader thread
+    HANDLE hEmpty, hFilled; // semaphores
+    LPBYTE pbBuffers[STREAM_BUFFERS];
+    DWORD cbFilled[STREAM_BUFFERS];
+    INT iHeld; // the buffer that the caller is using
+    volatile LONG fCancel;
+    volatile BOOL bError;
+    BOOL bEOF;
+    BOOL bPeeked; // the held buffer is read again
+    ULONGLONG cbTotal;
+} STREAM;
+
+#define DIGEST_BLOCK_SIZE 1024
+
+typedef struct DIGEST
+{
+    ULONGLONG lo, hi;
+} DIGEST;
+
+typedef struct DIGEST_STATE
+{
+    ULONGLONG acc[8];
+    ULONGLONG cbTotal;
+    BYTE buffer[DIGEST_BLOCK_SIZE];
+    DWORD cbBuffer;
+} DIGEST_STATE;
+
+typedef struct ARENA
+{
+    struct ARENA_BLOCK *blocks;
+    struct ARENA_VIEW *views; // unmapped on ArenaFree
+} ARENA;
+
+// A view or a buffer of a file and the lines made from it. The blocks are
+// released in order when the comparison has passed their lines.
+typedef struct TEXT_BLOCK
+{
+    struct TEXT_BLOCK *next;
+    ARENA arena; // the view and the transformed lines
+    DWORD iEnd; // the lines before iEnd are in this block or the older ones
+    LPCVOID pch; // the text of the block
+    DWORD cch;
+    BOOL bCopy; // the text is in a stream buffer, so the lines are copied
+    DWORD *pichEnds; // the line ends found, until the lines are added
+    ULONGLONG *pHashes; // the hashes of the lines to pichEnds
+    DWORD cEnds;
+    BOOL bLast; // the last block of the file
+    DWORD dwError; // ERROR_NOT_ENOUGH_MEMORY or ERROR_READ_FAULT
+} TEXT_BLOCK;
+
+#define TEXT_READ_AHEAD 2 // # of blocks that the reader thread may read ahead
+
+// A file being compared as text. The mapped files are read a view at a time
+// and the streams a buffer at a time. A large file or a stream is read by its
+// own thread while the lines before are being compared.
+typedef struct TEXT_FILE
+{
+    struct FILECOMPARE *pFC;
+    INT iFile;
+    HANDLE hThread; // reader thread if any
+    HANDLE hFree, hReady; // semaphores of the free and the filled slots
+    TEXT_BLOCK *ahead[TEXT_READ_AHEAD]; // ring of the blocks read ahead
+    INT iAhead; // the next slot to take
+    volatile LONG fCancel;
+    HANDLE *phMapping;
+    const LARGE_INTEGER *pcb;
+    ULONGLONG ib; // the offset of the next view. Aligned to MAX_VIEW_SIZE
+    TEXT_BLOCK *blocks, *lastBlock; // the oldest first
+    LPVOID pCarry; // the partial line at the end of the last block
+    DWORD cchCarry, cchCarryMax;
+    DWORD cbSkip; // the byte order mark not skipped yet
+    BYTE abPartial[8]; // the bytes of a character cut off by the end of the block
+    DWORD cbPartial;
+    BOOL bEOF; // the EOF line is added
+} TEXT_FILE;
+
+// A line normalized to be compared as a string or to be printed
+typedef struct TEXT_BUFFER
+{
+    LPVOID pch;
+    DWORD cchMax;
+} TEXT_BUFFER;
+
+typedef struct CACHE_ENTRY
+{
+    ULONGLONG key; // hash of the full path
+    ULONGLONG cbFile;
+    ULONGLONG ftLastWrite;
+    ULONGLONG fileIndex;
+    DWORD dwVolume;
+    DWORD dwReserved;
+    DIGEST digest;
+} CACHE_ENTRY;
+
+typedef struct CACHE
+{
+    LPCWSTR file;
+    LPVOID pHeader; // the loaded cache file
+    const CACHE_ENTRY *entries; // sorted by key
+    DWORD cEntries;
+    CACHE_ENTRY *added; // new digests of this run
+    DWORD cAdded, cCapacity;
+    CRITICAL_SECTION lock; // for added
+} CACHE;
+
+// The counters and the timings of /STATS. The timings are in the ticks of
+// QueryPerformanceCounter, summed over the threads.
+typedef struct STATS
+{
+    LONGLONG cbMapped, cViews; // the views of the mapped files
+    LONGLONG cbStreamed; // read by the streams
+    LONGLONG cbTouched; // compared or read from both files before the outcome was known
+    LONGLONG cLines; // the lines parsed
+    LONGLONG cAllocs; // the arena blocks, the line chunks, the text blocks and the buffers
+    LONGLONG cLineCompares; // the lines compared by their IDs
+    LONGLONG cTextCompares; // the texts compared for the same hashes
+    LONGLONG cHashRejects; // the slots skipped for the different hashes
+    LONGLONG cResyncs, cResyncLines, cResyncMaxWindow; // the lines searched by Resync
+    LONGLONG cchWritten; // the characters written by the output sink
+    LONGLONG qpcMap, qpcRead, qpcParse, qpcResync, qpcOutput, qpcTotal;
+    BOOL bJSON; // /STATS:JSON
+} STATS;
 
 typedef struct FILECOMPARE
 {
     DWORD dwFlags; // FLAG_...
     INT n; // # of line buffers
     INT nnnn; // retry count before resynch
+    ALGO nAlgo; // text comparison engine
+    INT nThreads; // # of worker threads (/J), or zero if not given
+    INT nRangeBytes; // # of bytes shown for each range (/RANGE:n)
+    ULONGLONG nMaxDiff; // stop after this many differing ranges (/MAXDIFF:n)
     LPCWSTR file[2];
-    struct list list[2];
+    LINES lines[2];
+    INTERN intern; // line classes shared by both files
+    TEXT_FILE text[2];
+    TEXT_BUFFER buffer[2]; // [0] for the line being added or printed
+    STREAM *stream[2]; // non-NULL if streamed
+    ENCODING encoding[2]; // of the text files
+    DWORD cbBOM[2]; // the sizes of the byte order marks
+    DIGEST digest[2];
+    BOOL bDigest[2]; // digest[i] is valid
+    CACHE *cache; // digest cache (/CACHE:file)
 } FILECOMPARE;
 
+// What a worker thread would print. The main thread prints it in order.
+typedef struct DEFERRED_OUTPUT
+{
+    LPWSTR pch; // the standard output
+    SIZE_T cch, cchMax;
+    BOOL bNoMemory; // some of the standard output is lost
+    LPWSTR pszError; // the first error message, or NULL
+    SIZE_T ichError; // where the error comes in the standard output
+} DEFERRED_OUTPUT;
+
+// The counters are only a test of g_pStats when /STATS is off
+extern STATS *g_pStats;
+#define STATS_ADD(field, n) \
+    do { if (g_pStats) InterlockedExchangeAdd64(&g_pStats->field, (LONGLONG)(n)); } while (0)
+#define STATS_MAX(field, n) \
+    do { if (g_pStats) StatsMax(&g_pStats->field, (LONGLONG)(n)); } while (0)
+#define STATS_START() (g_pStats ? StatsNow() : 0)
+#define STATS_STOP(field, t0) STATS_ADD(field, StatsNow() - (t0))
+
 // text.h
 FCRET TextCompareW(FILECOMPARE *pFC,
                    HANDLE *phMapping0, const LARGE_INTEGER *pcb0,
@@ -76,20 +292,66 @@ FCRET TextCompareA(FILECOMPARE *pFC,
                    HANDLE *phMapping0, const LARGE_INTEGER *pcb0,
                    HANDLE *phMapping1, const LARGE_INTEGER *pcb1);
 // fc.c
-VOID PrintLineW(const FILECOMPARE *pFC, DWORD lineno, LPCWSTR psz);
-VOID PrintLineA(const FILECOMPARE *pFC, DWORD lineno, LPCSTR psz);
+VOID PrintLineW(const FILECOMPARE *pFC, DWORD lineno, LPCWSTR pch, DWORD cch);
+VOID PrintLineA(const FILECOMPARE *pFC, DWORD lineno, LPCSTR pch, DWORD cch);
 VOID PrintCaption(LPCWSTR file);
 VOID PrintEndOfDiff(VOID);
 VOID PrintDots(VOID);
 FCRET NoDifference(VOID);
 FCRET Different(LPCWSTR file0, LPCWSTR file1);
 FCRET LongerThan(LPCWSTR file0, LPCWSTR file1);
+FCRET OnlyIn(LPCWSTR file, LPCWSTR dir);
 FCRET OutOfMemory(VOID);
 FCRET CannotRead(LPCWSTR file);
+FCRET CannotOpen(LPCWSTR file);
+FCRET PathTooLong(LPCWSTR dir);
 FCRET InvalidSwitch(VOID);
 FCRET ResyncFailed(VOID);
 HANDLE DoOpenFileForInput(LPCWSTR file);
+VOID BeginFileCompare(const FILECOMPARE *pFC);
+VOID EndFileCompare(const FILECOMPARE *pFC);
+FCRET FileCompare(FILECOMPARE *pFC);
+FCRET WildcardFileCompare(FILECOMPARE *pFC);
+VOID DeferOutput(DEFERRED_OUTPUT *output);
+FCRET PrintDeferredOutput(DEFERRED_OUTPUT *output);
+VOID FreeDeferredOutput(DEFERRED_OUTPUT *output);
+LONGLONG StatsNow(VOID);
+VOID StatsMax(LONGLONG *pValue, LONGLONG value);
+// stream.c
+BOOL StreamOpen(STREAM *stream, LPCWSTR file);
+BOOL StreamRead(STREAM *stream, const BYTE **ppb, DWORD *pcb);
+BOOL StreamPeek(STREAM *stream, const BYTE **ppb, DWORD *pcb);
+VOID StreamCancel(STREAM *stream);
+VOID StreamClose(STREAM *stream);
+// digest.c
+VOID DigestInit(DIGEST_STATE *state);
+VOID DigestUpdate(DIGEST_STATE *state, const BYTE *pb, SIZE_T cb);
+VOID DigestFinal(DIGEST_STATE *state, DIGEST *digest);
+// arena.c
+LPVOID ArenaAlloc(ARENA *arena, SIZE_T cb);
+BOOL ArenaAddView(ARENA *arena, LPVOID pView);
+VOID ArenaFree(ARENA *arena);
+// encoding.c
+ENCODING DetectEncoding(DWORD dwFlags, const BYTE *pb, DWORD cb, DWORD *pcbBOM);
+DWORD DecodeText(ENCODING nEncoding, const BYTE *pb, DWORD cb, LPWSTR pch, BOOL bFinal,
+                 DWORD *pcbUsed);
+// cache.c
+VOID CacheLoad(CACHE *cache, LPCWSTR file);
+BOOL CacheLookup(CACHE *cache, LPCWSTR file, CACHE_ENTRY *entry);
+VOID CacheStore(CACHE *cache, const CACHE_ENTRY *entry);
+BOOL CacheSave(CACHE *cache);
+VOID CacheFree(CACHE *cache);
+// tree.c
+FCRET TreeFileCompare(FILECOMPARE *pFC);
+// mismatch.c
+SIZE_T FindMismatch(const BYTE *pb0, const BYTE *pb1, SIZE_T cb);
+LPCWSTR FindMismatchName(VOID);
+
+#define MAX_THREADS 64 // MAXIMUM_WAIT_OBJECTS
+#define MAX_RANGE_BYTES 16
 
+// A multiple of the allocation granularity (64 KB), so that the views of
+// the consecutive offsets can be mapped
 #ifdef _WIN64
     #define MAX_VIEW_SIZE (256 * 1024 * 1024) // 256 MB
 #else
@@ -0,0 +1,460 @@
+/*
+ * PROJECT:     ReactOS FC Command
+ * LICENSE:     GPL-2.0-or-later (https://spdx.org/licenses/GPL-2.0-or-later)
+ * PURPOSE:     Benchmarking the hot paths of FC
+ * COPYRIGHT:   Copyright 2021 Katayama Hirofumi MZ (katayama.hirofumi.mz@gmail.com)
+ */
+#include "fc.h"
+#include <stdio.h>
+#include <io.h>
+#include <strsafe.h>
+#include <shlwapi.h>
+
+#define BENCH_SIZE (64 * 1024 * 1024) // 64 MB
+#define BENCH_LOOPS 16
+#define BENCH_FILE_LOOPS 4 // the files are compared fewer times than the buffers
+#define BENCH_TEXT_LINES (256 * 1024)
+#define BENCH_LONG_LINES 256
+#define BENCH_LONG_LINE_SIZE (64 * 1024) // characters
+#define BENCH_TREE_FILES 1000
+#define BENCH_TREE_LINES 20
+
+// The results are written to the original standard output as JSON lines.
+// The reports of the compares go to NUL.
+static FILE *s_fpResults = NULL;
+static WCHAR s_szDir[MAX_PATH];
+static INT s_nJobs = 1; // the # of the threads of /J, which is of all processors
+
+typedef struct BENCH_BUFFER
+{
+    LPBYTE pb;
+    SIZE_T cb, cbMax;
+} BENCH_BUFFER;
+
+typedef enum TEXT_WORKLOAD
+{
+    TEXT_SCATTERED = 0, // about one line in a thousand is edited
+    TEXT_SHUFFLED, // some blocks of lines are swapped
+    TEXT_LONG_LINES // a character in the middle of some long lines is edited
+} TEXT_WORKLOAD;
+
+static const char *s_apszTextWorkloads[] = { "scattered", "shuffled", "long_lines" };
+
+static double GetSeconds(VOID)
+{
+    static LARGE_INTEGER s_freq;
+    LARGE_INTEGER counter;
+    if (!s_freq.QuadPart)
+        QueryPerformanceFrequency(&s_freq);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)s_freq.QuadPart;
+}
+
+static VOID PrintResult(const char *name, double bytes, double seconds)
+{
+    fprintf(s_fpResults, "{\"bench\":\"%s\",\"bytes\":%.0f,\"seconds\":%.6f,\"MBps\":%.1f}\n",
+            name, bytes, seconds, bytes / seconds / (1024 * 1024));
+}
+
+// The latency is of a compare, and the lines are of both files. nThreads is
+// zero without /J.
+static VOID PrintFileResult(const char *name, INT nThreads, double bytes, double lines,
+                            INT cLoops, double seconds)
+{
+    fprintf(s_fpResults,
+            "{\"bench\":\"%s\",\"threads\":%d,\"bytes\":%.0f,\"lines\":%.0f,"
+            "\"seconds\":%.6f,\"MBps\":%.1f,\"linesps\":%.0f,\"latency_ms\":%.3f}\n",
+            name, (nThreads ? nThreads : 1), bytes, lines, seconds,
+            bytes / seconds / (1024 * 1024), lines / seconds, seconds * 1000 / cLoops);
+}
+
+static VOID BenchFindMismatch(LPBYTE pb0, LPBYTE pb1)
+{
+    double t0, t1;
+    SIZE_T ib, cbTotal = 0;
+    INT i;
+
+    fprintf(s_fpResults, "{\"kernel\":\"%ls\"}\n", FindMismatchName());
+
+    // identical buffers: the whole span is scanned in one call
+    memcpy(pb1, pb0, BENCH_SIZE);
+    t0 = GetSeconds();
+    for (i = 0; i < BENCH_LOOPS; ++i)
+        cbTotal += FindMismatch(pb0, pb1, BENCH_SIZE);
+    t1 = GetSeconds();
+    PrintResult("FindMismatch/identical", (double)cbTotal, t1 - t0);
+
+    // sparse flips: one differing byte per 64 KB
+    for (ib = 0; ib < BENCH_SIZE; ib += 64 * 1024)
+        pb1[ib + 12345] ^= 0xFF;
+    cbTotal = 0;
+    t0 = GetSeconds();
+    for (i = 0; i < BENCH_LOOPS; ++i)
+    {
+        for (ib = 0; ib < BENCH_SIZE; ++ib)
+            ib += FindMismatch(&pb0[ib], &pb1[ib], BENCH_SIZE - ib);
+        cbTotal += BENCH_SIZE;
+    }
+    t1 = GetSeconds();
+    PrintResult("FindMismatch/sparse", (double)cbTotal, t1 - t0);
+}
+
+static VOID GetBenchPath(LPWSTR pszPath, LPCWSTR pszName)
+{
+    StringCchCopyW(pszPath, MAX_PATH, s_szDir);
+    PathAppendW(pszPath, pszName);
+}
+
+static BOOL WriteBenchFile(LPCWSTR pszName, const BYTE *pb, SIZE_T cb)
+{
+    WCHAR szPath[MAX_PATH];
+    HANDLE hFile;
+    DWORD cbWritten, cbChunk;
+    BOOL bOK = TRUE;
+
+    GetBenchPath(szPath, pszName);
+    hFile = CreateFileW(szPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+    while (bOK && cb > 0)
+    {
+        cbChunk = (DWORD)min(cb, 16 * 1024 * 1024);
+        bOK = WriteFile(hFile, pb, cbChunk, &cbWritten, NULL) && cbWritten == cbChunk;
+        pb += cbChunk;
+        cb -= cbChunk;
+    }
+    CloseHandle(hFile);
+    return bOK;
+}
+
+static BOOL AppendBuffer(BENCH_BUFFER *buffer, const void *pv, SIZE_T cb)
+{
+    LPBYTE pbNew;
+    SIZE_T cbMax;
+    if (buffer->cb + cb > buffer->cbMax)
+    {
+        cbMax = max(buffer->cb + cb, 2 * buffer->cbMax);
+        pbNew = realloc(buffer->pb, cbMax);
+        if (!pbNew)
+            return FALSE;
+        buffer->pb = pbNew;
+        buffer->cbMax = cbMax;
+    }
+    memcpy(&buffer->pb[buffer->cb], pv, cb);
+    buffer->cb += cb;
+    return TRUE;
+}
+
+// Makes the text of file #iFile of the workload. The lines are ASCII.
+static BOOL
+GenerateText(TEXT_WORKLOAD nWorkload, INT iFile, BENCH_BUFFER *buffer, DWORD *pcLines)
+{
+    char sz[128], *pszLong = NULL;
+    INT i, iLine, cch;
+    HRESULT hr;
+    BOOL bOK = TRUE;
+
+    buffer->cb = 0;
+    *pcLines = 0;
+    switch (nWorkload)
+    {
+        case TEXT_SCATTERED:
+        case TEXT_SHUFFLED:
+            for (i = 0; bOK && i < BENCH_TEXT_LINES; ++i)
+            {
+                iLine = i;
+                // the blocks of 32 lines are swapped with the next ones at times
+                if (nWorkload == TEXT_SHUFFLED && iFile == 1 && (i / 32) % 64 < 2)
+                    iLine = ((i / 32) % 64 == 0) ? i + 32 : i - 32;
+                if (nWorkload == TEXT_SCATTERED && iFile == 1 && i % 997 == 500)
+                    hr = StringCchPrintfA(sz, _countof(sz), "%08d: edited\r\n", iLine);
+                else
+                    hr = StringCchPrintfA(sz, _countof(sz),
+                                          "%08d: The quick brown fox jumps over the lazy dog %d\r\n",
+                                          iLine, iLine % 17);
+                bOK = SUCCEEDED(hr) && AppendBuffer(buffer, sz, strlen(sz));
+                ++*pcLines;
+            }
+            break;
+        case TEXT_LONG_LINES:
+            pszLong = malloc(BENCH_LONG_LINE_SIZE + 2);
+            if (!pszLong)
+                return FALSE;
+            for (i = 0; bOK && i < BENCH_LONG_LINES; ++i)
+            {
+                for (cch = 0; cch < BENCH_LONG_LINE_SIZE; ++cch)
+                    pszLong[cch] = (char)('a' + (cch * 7 + i) % 26);
+                if (iFile == 1 && i % 16 == 0)
+                    pszLong[BENCH_LONG_LINE_SIZE / 2] = '#';
+                pszLong[cch++] = '\r';
+                pszLong[cch++] = '\n';
+                bOK = AppendBuffer(buffer, pszLong, cch);
+                ++*pcLines;
+            }
+            free(pszLong);
+            break;
+    }
+    return bOK;
+}
+
+// Writes the ASCII text as it is, or as UTF-16LE with the byte order mark
+static BOOL WriteTextFile(LPCWSTR pszName, const BENCH_BUFFER *buffer, BOOL bWide)
+{
+    LPWSTR pszWide;
+    SIZE_T ich;
+    BOOL bOK;
+
+    if (!bWide)
+        return WriteBenchFile(pszName, buffer->pb, buffer->cb);
+
+    pszWide = malloc((buffer->cb + 1) * sizeof(WCHAR));
+    if (!pszWide)
+        return FALSE;
+    pszWide[0] = 0xFEFF;
+    for (ich = 0; ich < buffer->cb; ++ich)
+        pszWide[ich + 1] = buffer->pb[ich];
+    bOK = WriteBenchFile(pszName, (const BYTE *)pszWide, (buffer->cb + 1) * sizeof(WCHAR));
+    free(pszWide);
+    return bOK;
+}
+
+static FCRET
+CompareBenchFiles(DWORD dwFlags, INT nThreads, LPCWSTR pszName0, LPCWSTR pszName1)
+{
+    FILECOMPARE fc = { .dwFlags = dwFlags, .n = 100, .nnnn = 2, .nThreads = nThreads };
+    WCHAR szPath0[MAX_PATH], szPath1[MAX_PATH];
+
+    GetBenchPath(szPath0, pszName0);
+    GetBenchPath(szPath1, pszName1);
+    fc.file[0] = szPath0;
+    fc.file[1] = szPath1;
+    return WildcardFileCompare(&fc);
+}
+
+// Identical large binaries, sparse byte flips and dense tail differences,
+// compared without and with /J
+static VOID BenchBinaryFileCompare(LPBYTE pb0, LPBYTE pb1)
+{
+    static const char *s_apszNames[] = { "identical", "sparse", "dense_tail" };
+    char szName[64];
+    double t0, t1;
+    SIZE_T ib;
+    INT iWorkload, nThreads, i;
+
+    if (!WriteBenchFile(L"bin0.bin", pb0, BENCH_SIZE))
+        return;
+
+    for (iWorkload = 0; iWorkload < (INT)_countof(s_apszNames); ++iWorkload)
+    {
+        memcpy(pb1, pb0, BENCH_SIZE);
+        if (iWorkload == 1)
+        {
+            // one differing byte per 64 KB
+            for (ib = 0; ib < BENCH_SIZE; ib += 64 * 1024)
+                pb1[ib + 12345] ^= 0xFF;
+        }
+        else if (iWorkload == 2)
+        {
+            // the last 1 MB differs everywhere
+            for (ib = BENCH_SIZE - 1024 * 1024; ib < BENCH_SIZE; ++ib)
+                pb1[ib] ^= 0xFF;
+        }
+        if (!WriteBenchFile(L"bin1.bin", pb1, BENCH_SIZE))
+            return;
+
+        StringCchPrintfA(szName, _countof(szName), "BinaryFileCompare/%s", s_apszNames[iWorkload]);
+        for (nThreads = 0; nThreads <= s_nJobs; nThreads += s_nJobs)
+        {
+            t0 = GetSeconds();
+            for (i = 0; i < BENCH_FILE_LOOPS; ++i)
+                CompareBenchFiles(FLAG_B, nThreads, L"bin0.bin", L"bin1.bin");
+            t1 = GetSeconds();
+            PrintFileResult(szName, nThreads, 2.0 * BENCH_SIZE * BENCH_FILE_LOOPS, 0,
+                            BENCH_FILE_LOOPS, t1 - t0);
+        }
+    }
+}
+
+// Text with scattered edits, shuffled blocks and very long lines, compared by
+// TextCompareA (ASCII with /L) and TextCompareW (UTF-16LE), without and with /J
+static VOID BenchTextCompare(BOOL bWide)
+{
+    BENCH_BUFFER buffers[2];
+    DWORD cLines[2];
+    char szName[64];
+    double t0, t1, cb;
+    INT iWorkload, nThreads, i;
+
+    ZeroMemory(buffers, sizeof(buffers));
+    for (iWorkload = 0; iWorkload < (INT)_countof(s_apszTextWorkloads); ++iWorkload)
+    {
+        if (!GenerateText((TEXT_WORKLOAD)iWorkload, 0, &buffers[0], &cLines[0]) ||
+            !GenerateText((TEXT_WORKLOAD)iWorkload, 1, &buffers[1], &cLines[1]) ||
+            !WriteTextFile(L"text0.txt", &buffers[0], bWide) ||
+            !WriteTextFile(L"text1.txt", &buffers[1], bWide))
+        {
+            break;
+        }
+
+        cb = (double)(buffers[0].cb + buffers[1].cb) * (bWide ? sizeof(WCHAR) : 1);
+        StringCchPrintfA(szName, _countof(szName), "TextCompare%c/%s",
+                         (bWide ? 'W' : 'A'), s_apszTextWorkloads[iWorkload]);
+        for (nThreads = 0; nThreads <= s_nJobs; nThreads += s_nJobs)
+        {
+            t0 = GetSeconds();
+            for (i = 0; i < BENCH_FILE_LOOPS; ++i)
+                CompareBenchFiles((bWide ? 0 : FLAG_L), nThreads, L"text0.txt", L"text1.txt");
+            t1 = GetSeconds();
+            PrintFileResult(szName, nThreads, cb * BENCH_FILE_LOOPS,
+                            (double)(cLines[0] + cLines[1]) * BENCH_FILE_LOOPS,
+                            BENCH_FILE_LOOPS, t1 - t0);
+        }
+    }
+    free(buffers[0].pb);
+    free(buffers[1].pb);
+}
+
+// Trees of many small files, compared by the wildcards of both sides, the
+// wildcard of one side and /R. One file in ten differs.
+static VOID BenchWildcardFileCompare(VOID)
+{
+    static const struct
+    {
+        const char *name;
+        DWORD dwFlags;
+        LPCWSTR pszName0, pszName1;
+        INT cFiles; // # of the files compared
+    } s_benches[] = {
+        { "WildcardFileCompare/both", 0, L"tree0\\*.txt", L"tree1\\*.txt", BENCH_TREE_FILES },
+        { "WildcardFileCompare/one_side", 0, L"tree0\\*.txt", L"tree1\\f0000.txt", BENCH_TREE_FILES },
+        { "TreeFileCompare", FLAG_R, L"tree0", L"tree1", BENCH_TREE_FILES },
+    };
+    BENCH_BUFFER buffer = { NULL, 0, 0 };
+    WCHAR szName[MAX_PATH], szPath[MAX_PATH];
+    char sz[128];
+    double t0, t1;
+    INT iBench, iTree, iFile, iLine, i;
+    BOOL bOK = TRUE;
+
+    for (iTree = 0; bOK && iTree < 2; ++iTree)
+    {
+        StringCchPrintfW(szName, _countof(szName), L"tree%d", iTree);
+        GetBenchPath(szPath, szName);
+        CreateDirectoryW(szPath, NULL);
+        for (iFile = 0; bOK && iFile < BENCH_TREE_FILES; ++iFile)
+        {
+            buffer.cb = 0;
+            for (iLine = 0; bOK && iLine < BENCH_TREE_LINES; ++iLine)
+            {
+                StringCchPrintfA(sz, _countof(sz), "file %d line %d%s\r\n", iFile, iLine,
+                                 (iTree == 1 && iFile % 10 == 0 && iLine == 10) ? " edited" : "");
+                bOK = AppendBuffer(&buffer, sz, strlen(sz));
+            }
+            StringCchPrintfW(szName, _countof(szName), L"tree%d\\f%04d.txt", iTree, iFile);
+            bOK = bOK && WriteBenchFile(szName, buffer.pb, buffer.cb);
+        }
+    }
+    free(buffer.pb);
+    if (!bOK)
+        return;
+
+    for (iBench = 0; iBench < (INT)_countof(s_benches); ++iBench)
+    {
+        t0 = GetSeconds();
+        for (i = 0; i < BENCH_FILE_LOOPS; ++i)
+            CompareBenchFiles(s_benches[iBench].dwFlags, 0,
+                              s_benches[iBench].pszName0, s_benches[iBench].pszName1);
+        t1 = GetSeconds();
+        fprintf(s_fpResults,
+                "{\"bench\":\"%s\",\"files\":%d,\"seconds\":%.6f,\"filesps\":%.0f,"
+                "\"latency_ms\":%.3f}\n",
+                s_benches[iBench].name, s_benches[iBench].cFiles * BENCH_FILE_LOOPS, t1 - t0,
+                s_benches[iBench].cFiles * BENCH_FILE_LOOPS / (t1 - t0),
+                (t1 - t0) * 1000 / (s_benches[iBench].cFiles * BENCH_FILE_LOOPS));
+    }
+}
+
+// Deletes the files and the directories made by the benchmarks
+static VOID DeleteBenchDir(LPCWSTR pszDir)
+{
+    WCHAR szPath[MAX_PATH];
+    WIN32_FIND_DATAW find;
+    HANDLE hFind;
+
+    StringCchCopyW(szPath, _countof(szPath), pszDir);
+    PathAppendW(szPath, L"*");
+    hFind = FindFirstFileW(szPath, &find);
+    if (hFind != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            if (find.cFileName[0] == L'.')
+                continue;
+            StringCchCopyW(szPath, _countof(szPath), pszDir);
+            PathAppendW(szPath, find.cFileName);
+            if (find.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+                DeleteBenchDir(szPath);
+            else
+                DeleteFileW(szPath);
+        } while (FindNextFileW(hFind, &find));
+        FindClose(hFind);
+    }
+    RemoveDirectoryW(pszDir);
+}
+
+int main(void)
+{
+    LPBYTE pb0 = malloc(BENCH_SIZE), pb1 = malloc(BENCH_SIZE);
+    SYSTEM_INFO info;
+    SIZE_T ib;
+    INT fd;
+
+    if (!pb0 || !pb1)
+    {
+        free(pb0);
+        free(pb1);
+        fprintf(stderr, "fc_bench: Out of memory\n");
+        return 1;
+    }
+
+    // the compares print their reports to the standard output
+    fd = _dup(_fileno(stdout));
+    s_fpResults = (fd != -1 ? _fdopen(fd, "w") : NULL);
+    if (!s_fpResults || !freopen("NUL", "w", stdout))
+    {
+        free(pb0);
+        free(pb1);
+        fprintf(stderr, "fc_bench: Cannot redirect the output\n");
+        return 1;
+    }
+
+    GetTempPathW(_countof(s_szDir), s_szDir);
+    StringCchPrintfW(s_szDir + wcslen(s_szDir), _countof(s_szDir) - wcslen(s_szDir),
+                     L"fc_bench.%lu", GetCurrentProcessId());
+    if (!CreateDirectoryW(s_szDir, NULL))
+    {
+        free(pb0);
+        free(pb1);
+        fprintf(stderr, "fc_bench: Cannot create %ls\n", s_szDir);
+        return 1;
+    }
+
+    for (ib = 0; ib < BENCH_SIZE; ++ib)
+        pb0[ib] = (BYTE)(ib * 2654435761u >> 13);
+
+    // the same as /J
+    GetSystemInfo(&info);
+    s_nJobs = (INT)min(info.dwNumberOfProcessors, MAX_THREADS);
+
+    BenchFindMismatch(pb0, pb1);
+    BenchBinaryFileCompare(pb0, pb1);
+    BenchTextCompare(FALSE);
+    BenchTextCompare(TRUE);
+    BenchWildcardFileCompare();
+
+    DeleteBenchDir(s_szDir);
+    fclose(s_fpResults);
+    free(pb0);
+    free(pb1);
+    return 0;
+}
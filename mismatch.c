@@ -0,0 +1,161 @@
+/*
+ * PROJECT:     ReactOS FC Command
+ * LICENSE:     GPL-2.0-or-later (https://spdx.org/licenses/GPL-2.0-or-later)
+ * PURPOSE:     Finding the first mismatched byte of two memory blocks
+ * COPYRIGHT:   Copyright 2021 Katayama Hirofumi MZ (katayama.hirofumi.mz@gmail.com)
+ */
+#include "fc.h"
+#include "simd.h"
+
+typedef SIZE_T (*FN_FIND_MISMATCH)(const BYTE *pb0, const BYTE *pb1, SIZE_T cb);
+
+static SIZE_T FindMismatchScalar(const BYTE *pb0, const BYTE *pb1, SIZE_T cb)
+{
+    SIZE_T ib = 0;
+    ULONGLONG qw0, qw1;
+
+    // compare eight bytes at a time (little endian)
+    for (; ib + sizeof(ULONGLONG) <= cb; ib += sizeof(ULONGLONG))
+    {
+        memcpy(&qw0, &pb0[ib], sizeof(qw0));
+        memcpy(&qw1, &pb1[ib], sizeof(qw1));
+        if (qw0 != qw1)
+            return ib + LowestBit64(qw0 ^ qw1) / 8;
+    }
+
+    for (; ib < cb; ++ib)
+    {
+        if (pb0[ib] != pb1[ib])
+            break;
+    }
+    return ib;
+}
+
+#ifdef FC_X86
+TARGET_SSE2
+static SIZE_T FindMismatchSSE2(const BYTE *pb0, const BYTE *pb1, SIZE_T cb)
+{
+    SIZE_T ib = 0;
+    DWORD mask;
+    __m128i x0, x1;
+
+    for (; ib + 16 <= cb; ib += 16)
+    {
+        x0 = _mm_loadu_si128((const __m128i *)&pb0[ib]);
+        x1 = _mm_loadu_si128((const __m128i *)&pb1[ib]);
+        mask = (DWORD)_mm_movemask_epi8(_mm_cmpeq_epi8(x0, x1)) ^ 0xFFFF;
+        if (mask)
+            return ib + LowestBit32(mask);
+    }
+
+    return ib + FindMismatchScalar(&pb0[ib], &pb1[ib], cb - ib);
+}
+
+TARGET_AVX2
+static SIZE_T FindMismatchAVX2(const BYTE *pb0, const BYTE *pb1, SIZE_T cb)
+{
+    SIZE_T ib = 0;
+    DWORD mask0, mask1;
+    __m256i x0, x1, y0, y1;
+
+    // two vectors per iteration to keep both load ports busy
+    for (; ib + 64 <= cb; ib += 64)
+    {
+        x0 = _mm256_loadu_si256((const __m256i *)&pb0[ib]);
+        x1 = _mm256_loadu_si256((const __m256i *)&pb1[ib]);
+        y0 = _mm256_loadu_si256((const __m256i *)&pb0[ib + 32]);
+        y1 = _mm256_loadu_si256((const __m256i *)&pb1[ib + 32]);
+        mask0 = ~(DWORD)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x0, x1));
+        mask1 = ~(DWORD)_mm256_movemask_epi8(_mm256_cmpeq_epi8(y0, y1));
+        if (mask0 | mask1)
+        {
+            _mm256_zeroupper();
+            if (mask0)
+                return ib + LowestBit32(mask0);
+            return ib + 32 + LowestBit32(mask1);
+        }
+    }
+
+    for (; ib + 32 <= cb; ib += 32)
+    {
+        x0 = _mm256_loadu_si256((const __m256i *)&pb0[ib]);
+        x1 = _mm256_loadu_si256((const __m256i *)&pb1[ib]);
+        mask0 = ~(DWORD)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x0, x1));
+        if (mask0)
+        {
+            _mm256_zeroupper();
+            return ib + LowestBit32(mask0);
+        }
+    }
+
+    _mm256_zeroupper();
+    return ib + FindMismatchScalar(&pb0[ib], &pb1[ib], cb - ib);
+}
+
+TARGET_AVX512
+static SIZE_T FindMismatchAVX512(const BYTE *pb0, const BYTE *pb1, SIZE_T cb)
+{
+    SIZE_T ib = 0;
+    ULONGLONG mask;
+    __m512i x0, x1;
+
+    for (; ib + 64 <= cb; ib += 64)
+    {
+        x0 = _mm512_loadu_si512((const void *)&pb0[ib]);
+        x1 = _mm512_loadu_si512((const void *)&pb1[ib]);
+        mask = _mm512_cmpneq_epu8_mask(x0, x1);
+        if (mask)
+            return ib + LowestBit64(mask);
+    }
+
+    // the tail is handled by a masked compare
+    if (ib < cb)
+    {
+        __mmask64 k = (__mmask64)(~0ULL >> (64 - (cb - ib)));
+        x0 = _mm512_maskz_loadu_epi8(k, &pb0[ib]);
+        x1 = _mm512_maskz_loadu_epi8(k, &pb1[ib]);
+        mask = _mm512_mask_cmpneq_epu8_mask(k, x0, x1);
+        if (mask)
+            return ib + LowestBit64(mask);
+        ib = cb;
+    }
+    return ib;
+}
+#endif /* def FC_X86 */
+
+static PVOID ChooseFindMismatch(VOID)
+{
+#ifdef FC_X86
+    DWORD dwFeatures = GetCpuFeatures();
+    if (dwFeatures & CPU_AVX512)
+        return (PVOID)FindMismatchAVX512;
+    if (dwFeatures & CPU_AVX2)
+        return (PVOID)FindMismatchAVX2;
+    if (dwFeatures & CPU_SSE2)
+        return (PVOID)FindMismatchSSE2;
+#endif
+    return (PVOID)FindMismatchScalar;
+}
+
+static PVOID volatile s_pfnFindMismatch = NULL;
+
+// Returns the index of the first byte that differs, or cb if the blocks are identical.
+SIZE_T FindMismatch(const BYTE *pb0, const BYTE *pb1, SIZE_T cb)
+{
+    FN_FIND_MISMATCH pfn = (FN_FIND_MISMATCH)ChooseOnce(&s_pfnFindMismatch, ChooseFindMismatch);
+    return pfn(pb0, pb1, cb);
+}
+
+LPCWSTR FindMismatchName(VOID)
+{
+    PVOID pfn = ChooseFindMismatch();
+#ifdef FC_X86
+    if (pfn == (PVOID)FindMismatchAVX512)
+        return L"AVX-512";
+    if (pfn == (PVOID)FindMismatchAVX2)
+        return L"AVX2";
+    if (pfn == (PVOID)FindMismatchSSE2)
+        return L"SSE2";
+#endif
+    return L"scalar";
+}
@@ -0,0 +1,52 @@
+/*
+ * PROJECT:     ReactOS FC Command
+ * LICENSE:     GPL-2.0-or-later (https://spdx.org/licenses/GPL-2.0-or-later)
+ * PURPOSE:     Helpers for vectorized code
+ * COPYRIGHT:   Copyright 2021 Katayama Hirofumi MZ (katayama.hirofumi.mz@gmail.com)
+ */
+#pragma once
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+    #define FC_X86
+    #ifdef _MSC_VER
+        #include <intrin.h>
+        #define TARGET_SSE2   /* empty */
+        #define TARGET_AVX2   /* empty */
+        #define TARGET_AVX512 /* empty */
+    #else
+        #define TARGET_SSE2   __attribute__((target("sse2")))
+        #define TARGET_AVX2   __attribute__((target("avx2")))
+        #define TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+    #endif
+    #include <immintrin.h>
+#endif
+
+// GetCpuFeatures
+#define CPU_SSE2   (1 << 0)
+#define CPU_AVX2   (1 << 1)
+#define CPU_AVX512 (1 << 2) // AVX-512F and AVX-512BW
+
+DWORD GetCpuFeatures(VOID);
+
+// ChooseOnce
+typedef PVOID (*FN_CHOOSE)(VOID);
+
+PVOID ChooseOnce(PVOID volatile *ppv, FN_CHOOSE pfnChoose);
+
+static __inline DWORD LowestBit32(DWORD dw)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, dw);
+    return index;
+#else
+    return (DWORD)__builtin_ctz(dw);
+#endif
+}
+
+static __inline DWORD LowestBit64(ULONGLONG qw)
+{
+    if ((DWORD)qw)
+        return LowestBit32((DWORD)qw);
+    return 32 + LowestBit32((DWORD)(qw >> 32));
+}
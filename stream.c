@@ -0,0 +1,184 @@
+/*
+ * PROJECT:     ReactOS FC Command
+ * LICENSE:     GPL-2.0-or-later (https://spdx.org/licenses/GPL-2.0-or-later)
+ * PURPOSE:     Reading files sequentially with read-ahead
+ * COPYRIGHT:   Copyright 2021 Katayama Hirofumi MZ (katayama.hirofumi.mz@gmail.com)
+ */
+#include "fc.h"
+
+// The reader thread fills the buffers in turn while the caller is comparing the
+// previous ones. Every buffer but the last one is filled up completely, so the
+// buffers always begin at a multiple of STREAM_BUFFER_SIZE in the stream.
+static DWORD WINAPI StreamThreadProc(LPVOID arg)
+{
+    STREAM *stream = arg;
+    INT iBuffer = 0;
+    DWORD cbRead, cbFilled;
+    BOOL bEOF = FALSE;
+    LONGLONG t0;
+
+    for (;;)
+    {
+        WaitForSingleObject(stream->hEmpty, INFINITE);
+        if (stream->fCancel)
+            break;
+
+        // an empty buffer follows the last one to tell the end of the stream
+        t0 = STATS_START();
+        for (cbFilled = 0; !bEOF && !stream->fCancel && cbFilled < STREAM_BUFFER_SIZE;
+             cbFilled += cbRead)
+        {
+            if (!ReadFile(stream->hFile, &stream->pbBuffers[iBuffer][cbFilled],
+                          STREAM_BUFFER_SIZE - cbFilled, &cbRead, NULL))
+            {
+                // the writer of a pipe has closed it
+                if (GetLastError() != ERROR_BROKEN_PIPE)
+                    stream->bError = TRUE;
+                cbRead = 0;
+            }
+            if (cbRead == 0)
+                bEOF = TRUE;
+        }
+
+        STATS_STOP(qpcRead, t0);
+        STATS_ADD(cbStreamed, cbFilled);
+        stream->cbFilled[iBuffer] = cbFilled;
+        ReleaseSemaphore(stream->hFilled, 1, NULL);
+        iBuffer = (iBuffer + 1) % STREAM_BUFFERS;
+        if (cbFilled == 0)
+            break;
+    }
+    return 0;
+}
+
+// Opens a file for streaming. L"-" means the standard input.
+BOOL StreamOpen(STREAM *stream, LPCWSTR file)
+{
+    INT iBuffer;
+    BOOL bOK;
+
+    ZeroMemory(stream, sizeof(*stream));
+    if (wcscmp(file, L"-") == 0)
+    {
+        stream->hFile = GetStdHandle(STD_INPUT_HANDLE);
+    }
+    else
+    {
+        stream->hFile = DoOpenFileForInput(file);
+        stream->bOwnHandle = TRUE;
+    }
+    if (stream->hFile == INVALID_HANDLE_VALUE || stream->hFile == NULL)
+    {
+        stream->hFile = NULL;
+        return FALSE;
+    }
+
+    stream->hEmpty = CreateSemaphoreW(NULL, STREAM_BUFFERS, STREAM_BUFFERS, NULL);
+    stream->hFilled = CreateSemaphoreW(NULL, 0, STREAM_BUFFERS, NULL);
+    bOK = (stream->hEmpty && stream->hFilled);
+    for (iBuffer = 0; iBuffer < STREAM_BUFFERS; ++iBuffer)
+    {
+        stream->pbBuffers[iBuffer] = malloc(STREAM_BUFFER_SIZE);
+        if (!stream->pbBuffers[iBuffer])
+            bOK = FALSE;
+    }
+    STATS_ADD(cAllocs, STREAM_BUFFERS);
+    stream->iHeld = -1;
+
+    if (bOK)
+        stream->hThread = CreateThread(NULL, 0, StreamThreadProc, stream, 0, NULL);
+    if (!stream->hThread)
+    {
+        StreamClose(stream);
+        OutOfMemory();
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// Gets the next buffer. The previous buffer is given back to the reader thread.
+// *pcb is zero at the end of the stream.
+BOOL StreamRead(STREAM *stream, const BYTE **ppb, DWORD *pcb)
+{
+    INT iBuffer;
+
+    if (stream->bPeeked)
+    {
+        stream->bPeeked = FALSE;
+        *ppb = stream->pbBuffers[stream->iHeld];
+        *pcb = stream->cbFilled[stream->iHeld];
+        return !stream->bError;
+    }
+
+    if (stream->bEOF)
+    {
+        *ppb = NULL;
+        *pcb = 0;
+        return !stream->bError;
+    }
+
+    if (stream->iHeld >= 0)
+        ReleaseSemaphore(stream->hEmpty, 1, NULL);
+
+    iBuffer = (stream->iHeld + 1) % STREAM_BUFFERS;
+    WaitForSingleObject(stream->hFilled, INFINITE);
+    if (stream->fCancel)
+    {
+        *ppb = NULL;
+        *pcb = 0;
+        return FALSE;
+    }
+    stream->iHeld = iBuffer;
+
+    *ppb = stream->pbBuffers[iBuffer];
+    *pcb = stream->cbFilled[iBuffer];
+    stream->cbTotal += *pcb;
+    if (*pcb == 0)
+        stream->bEOF = TRUE;
+    return !stream->bError;
+}
+
+// Gets the next buffer without taking it. StreamRead returns it again.
+BOOL StreamPeek(STREAM *stream, const BYTE **ppb, DWORD *pcb)
+{
+    if (!StreamRead(stream, ppb, pcb))
+        return FALSE;
+    stream->bPeeked = TRUE;
+    return TRUE;
+}
+
+// Stops the reader thread. A thread waiting in StreamRead wakes up, and then
+// StreamRead fails.
+VOID StreamCancel(STREAM *stream)
+{
+    if (!stream->hThread)
+        return;
+
+    stream->fCancel = TRUE;
+    ReleaseSemaphore(stream->hEmpty, 1, NULL);
+    ReleaseSemaphore(stream->hFilled, 1, NULL);
+    // A thread blocked in ReadFile on a pipe doesn't see fCancel
+    if (WaitForSingleObject(stream->hThread, 0) != WAIT_OBJECT_0)
+        CancelSynchronousIo(stream->hThread);
+}
+
+VOID StreamClose(STREAM *stream)
+{
+    INT iBuffer;
+
+    if (stream->hThread)
+    {
+        StreamCancel(stream);
+        // the thread may have been between two reads when it was cancelled
+        while (WaitForSingleObject(stream->hThread, STREAM_CANCEL_RETRY) == WAIT_TIMEOUT)
+            CancelSynchronousIo(stream->hThread);
+        CloseHandle(stream->hThread);
+    }
+    CloseHandle(stream->hEmpty);
+    CloseHandle(stream->hFilled);
+    for (iBuffer = 0; iBuffer < STREAM_BUFFERS; ++iBuffer)
+        free(stream->pbBuffers[iBuffer]);
+    if (stream->bOwnHandle && stream->hFile)
+        CloseHandle(stream->hFile);
+    ZeroMemory(stream, sizeof(*stream));
+}
@@ -5,22 +5,32 @@
  * COPYRIGHT:   Copyright 2021 Katayama Hirofumi MZ (katayama.hirofumi.mz@gmail.com)
  */
 #include "fc.h"
+#include "simd.h"
 
 #define IS_SPACE(ch) ((ch) == TEXT(' ') || (ch) == TEXT('\t'))
 
 #ifdef UNICODE
-    #define NODE NODE_W
     #define PrintLine PrintLineW
     #define TextCompare TextCompareW
 #else
-    #define NODE NODE_A
     #define PrintLine PrintLineA
     #define TextCompare TextCompareA
 #endif
 
-static LPTSTR AllocLine(LPCTSTR pch, DWORD cch)
+// A line being built. The lines are not null-terminated. They are kept as they
+// are in the file, in the mapped view or in the arena if streamed. The tabs and
+// the spaces are normalized on the fly when they are hashed or compared.
+typedef struct LINE
 {
-    LPTSTR pszNew = malloc((cch + 1) * sizeof(TCHAR));
+    LPCTSTR pch;
+    DWORD cch;
+    DWORD id; // the class of the equal lines
+    ULONGLONG hash; // GetHash of the line if not zero
+} LINE;
+
+static LPTSTR AllocLine(ARENA *arena, LPCTSTR pch, DWORD cch)
+{
+    LPTSTR pszNew = ArenaAlloc(arena, (cch + 1) * sizeof(TCHAR));
     if (!pszNew)
         return NULL;
     memcpy(pszNew, pch, cch * sizeof(TCHAR));
@@ -28,582 +38,2491 @@ static LPTSTR AllocLine(LPCTSTR pch, DWORD cch)
     return pszNew;
 }
 
-static NODE *AllocNode(LPTSTR psz, DWORD lineno)
+#define ID_EOF 0xFFFFFFFF
+
+#define ROTL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+static __inline TCHAR FoldCase(TCHAR ch)
 {
-    NODE *node;
-    if (!psz)
-        return NULL;
-    node = calloc(1, sizeof(NODE));
-    if (!node)
+    if (ch >= TEXT('a') && ch <= TEXT('z'))
+        return ch - (TEXT('a') - TEXT('A'));
+    if ((TBYTE)ch < 0x80)
+        return ch;
+    return (TCHAR)towupper(ch);
+}
+
+// The long lines are hashed in stripes of 32 bytes, a 64-bit lane for each word
+// of the stripe, so that the stripes are hashed in vectors. Each lane is
+// rotated before a stripe is added, so that the order of the stripes matters.
+// The scalar and the vectorized versions give the same hash. The short lines
+// are mixed eight bytes at a time, which is faster than folding the lanes.
+#define HASH_STRIPE 32 // bytes
+#define HASH_LANES (HASH_STRIPE / sizeof(ULONGLONG))
+#define HASH_ROTATION 17
+#define HASH_LONG_LINE 256 // bytes
+
+static const ULONGLONG s_aHashKeys[HASH_LANES] = {
+    0x9E3779B185EBCA87ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0x85EBCA77C2B2AE63ULL
+};
+
+typedef VOID (*FN_HASH_STRIPES)(ULONGLONG *acc, const BYTE *pb, DWORD cStripes);
+
+typedef struct HASH_STATE
+{
+    FN_HASH_STRIPES pfnHashStripes;
+    ULONGLONG acc[HASH_LANES]; // of the whole stripes
+    TCHAR ach[HASH_LONG_LINE / sizeof(TCHAR)]; // the short line, or the partial stripe
+    DWORD ich; // # of the characters in ach
+    LPCTSTR pchTail; // the characters of ach left in the text, or NULL
+    DWORD cchTail;
+    BOOL bLong; // the line has stripes
+    BOOL bIgnoreCase;
+} HASH_STATE;
+
+#define HASH_STRIPE_CCH (HASH_STRIPE / sizeof(TCHAR))
+
+static __inline ULONGLONG MixWord(ULONGLONG hash, ULONGLONG w)
+{
+    hash ^= w * 0x87C37B91114253D5ULL;
+    return ROTL64(hash, 31) * 0x4CF5AD432745937FULL;
+}
+
+static VOID HashStripesScalar(ULONGLONG *acc, const BYTE *pb, DWORD cStripes)
+{
+    ULONGLONG w, wk;
+    DWORD i;
+
+    for (; cStripes > 0; --cStripes, pb += HASH_STRIPE)
     {
-        free(psz);
-        return NULL;
+        for (i = 0; i < HASH_LANES; ++i)
+        {
+            memcpy(&w, &pb[i * sizeof(w)], sizeof(w));
+            wk = w ^ s_aHashKeys[i];
+            acc[i] = ROTL64(acc[i], HASH_ROTATION) + w + (wk & 0xFFFFFFFF) * (wk >> 32);
+        }
     }
-    node->pszLine = psz;
-    node->lineno = lineno;
-    return node;
 }
 
-static __inline VOID DeleteNode(NODE *node)
+#ifdef FC_X86
+TARGET_SSE2
+static VOID HashStripesSSE2(ULONGLONG *acc, const BYTE *pb, DWORD cStripes)
 {
-    if (node)
+    const __m128i key0 = _mm_loadu_si128((const __m128i *)&s_aHashKeys[0]);
+    const __m128i key1 = _mm_loadu_si128((const __m128i *)&s_aHashKeys[2]);
+    __m128i acc0 = _mm_loadu_si128((const __m128i *)&acc[0]);
+    __m128i acc1 = _mm_loadu_si128((const __m128i *)&acc[2]);
+    __m128i w0, w1, wk0, wk1;
+
+    for (; cStripes > 0; --cStripes, pb += HASH_STRIPE)
     {
-        free(node->pszLine);
-        free(node->pszComp);
-        free(node);
+        w0 = _mm_loadu_si128((const __m128i *)&pb[0]);
+        w1 = _mm_loadu_si128((const __m128i *)&pb[16]);
+        wk0 = _mm_xor_si128(w0, key0);
+        wk1 = _mm_xor_si128(w1, key1);
+        acc0 = _mm_or_si128(_mm_slli_epi64(acc0, HASH_ROTATION), _mm_srli_epi64(acc0, 64 - HASH_ROTATION));
+        acc1 = _mm_or_si128(_mm_slli_epi64(acc1, HASH_ROTATION), _mm_srli_epi64(acc1, 64 - HASH_ROTATION));
+        acc0 = _mm_add_epi64(acc0, _mm_add_epi64(w0, _mm_mul_epu32(wk0, _mm_srli_epi64(wk0, 32))));
+        acc1 = _mm_add_epi64(acc1, _mm_add_epi64(w1, _mm_mul_epu32(wk1, _mm_srli_epi64(wk1, 32))));
     }
+
+    _mm_storeu_si128((__m128i *)&acc[0], acc0);
+    _mm_storeu_si128((__m128i *)&acc[2], acc1);
 }
 
-static VOID DeleteList(struct list *list)
+TARGET_AVX2
+static VOID HashStripesAVX2(ULONGLONG *acc, const BYTE *pb, DWORD cStripes)
 {
-    struct list *ptr;
-    NODE *node;
-    while ((ptr = list_head(list)) != NULL)
+    const __m256i key = _mm256_loadu_si256((const __m256i *)s_aHashKeys);
+    __m256i acc0 = _mm256_loadu_si256((const __m256i *)acc);
+    __m256i w, wk;
+
+    for (; cStripes > 0; --cStripes, pb += HASH_STRIPE)
     {
-        list_remove(ptr);
-        node = LIST_ENTRY(ptr, NODE, entry);
-        DeleteNode(node);
+        w = _mm256_loadu_si256((const __m256i *)pb);
+        wk = _mm256_xor_si256(w, key);
+        acc0 = _mm256_or_si256(_mm256_slli_epi64(acc0, HASH_ROTATION),
+                               _mm256_srli_epi64(acc0, 64 - HASH_ROTATION));
+        acc0 = _mm256_add_epi64(acc0, _mm256_add_epi64(w, _mm256_mul_epu32(wk, _mm256_srli_epi64(wk, 32))));
     }
+
+    _mm256_storeu_si256((__m256i *)acc, acc0);
+    _mm256_zeroupper();
 }
+#endif /* def FC_X86 */
 
-static __inline LPCTSTR SkipSpace(LPCTSTR pch)
+static PVOID ChooseHashStripes(VOID)
 {
-    while (IS_SPACE(*pch))
-        ++pch;
-    return pch;
+#ifdef FC_X86
+    DWORD dwFeatures = GetCpuFeatures();
+    if (dwFeatures & CPU_AVX2)
+        return (PVOID)HashStripesAVX2;
+    if (dwFeatures & CPU_SSE2)
+        return (PVOID)HashStripesSSE2;
+#endif
+    return (PVOID)HashStripesScalar;
 }
 
-static __inline LPCTSTR FindLastNonSpace(LPCTSTR pch)
+// The whole stripes are read from the text unless the cases are folded. The
+// rest is left in the text, for mostly nothing follows. A line is long once
+// HASH_LONG_LINE bytes have come.
+static VOID HashChars(HASH_STATE *state, LPCTSTR pch, DWORD cch)
 {
-    LPCTSTR pchLast = NULL;
-    while (*pch)
+    DWORD cStripes, cchCopy, cchFull;
+
+    if (state->pchTail)
     {
-        if (!IS_SPACE(*pch))
-            pchLast = pch;
-        ++pch;
+        memcpy(state->ach, state->pchTail, state->cchTail * sizeof(TCHAR));
+        state->ich = state->cchTail;
+        state->pchTail = NULL;
     }
-    return pchLast;
-}
 
-static VOID DeleteDuplicateSpaces(LPTSTR psz)
-{
-    LPTSTR pch0, pch1;
-    for (pch0 = pch1 = psz; *pch0; ++pch0)
+    for (;;)
     {
-        *pch1++ = *pch0;
-        if (IS_SPACE(*pch0))
+        if (state->ich == 0 && !state->bIgnoreCase)
         {
-            do
+            if (cch >= _countof(state->ach))
+                state->bLong = TRUE;
+            if (state->bLong)
+            {
+                cStripes = cch / HASH_STRIPE_CCH;
+                state->pfnHashStripes(state->acc, (const BYTE *)pch, cStripes);
+                pch += cStripes * HASH_STRIPE_CCH;
+                cch -= cStripes * HASH_STRIPE_CCH;
+            }
+            if (cch > 0)
             {
-                ++pch0;
-            } while (IS_SPACE(*pch0));
-            --pch0;
+                state->pchTail = pch;
+                state->cchTail = cch;
+            }
+            return;
+        }
+        if (cch == 0)
+            return;
+
+        cchFull = (state->bLong ? HASH_STRIPE_CCH : _countof(state->ach));
+        cchCopy = min(cch, cchFull - state->ich);
+        if (state->bIgnoreCase)
+        {
+            for (; cchCopy > 0; --cchCopy, --cch)
+                state->ach[state->ich++] = FoldCase(*pch++);
+        }
+        else
+        {
+            memcpy(&state->ach[state->ich], pch, cchCopy * sizeof(TCHAR));
+            state->ich += cchCopy;
+            pch += cchCopy;
+            cch -= cchCopy;
+        }
+        if (state->ich == cchFull)
+        {
+            state->pfnHashStripes(state->acc, (const BYTE *)state->ach, cchFull / HASH_STRIPE_CCH);
+            state->bLong = TRUE;
+            state->ich = 0;
         }
     }
-    *pch1 = 0;
 }
 
-static LPTSTR CompressSpace(LPCTSTR line)
-{
-    LPTSTR pszNew;
-    LPCTSTR pchLast;
+#define TAB_WIDTH 8
 
-    line = SkipSpace(line);
-    pchLast = FindLastNonSpace(line);
-    if (pchLast == NULL)
-        return AllocLine(NULL, 0);
+static const TCHAR s_szSpaces[TAB_WIDTH + 1] = TEXT("        ");
 
-    pszNew = AllocLine(line, (DWORD)(pchLast - line) + 1);
-    if (!pszNew)
-        return NULL;
+// Whether the normalization changes the character
+#define IS_NORM_CHAR(ch, dwFlags) \
+    (((dwFlags) & FLAG_W) ? IS_SPACE(ch) : ((ch) == TEXT('\t') && !((dwFlags) & FLAG_T)))
 
-    DeleteDuplicateSpaces(pszNew);
-    return pszNew;
+static __inline VOID
+PutChars(LPTSTR pszNew, DWORD ichNew, HASH_STATE *state, LPCTSTR pch, DWORD cch)
+{
+    if (pszNew)
+        memcpy(&pszNew[ichNew], pch, cch * sizeof(TCHAR));
+    if (state)
+        HashChars(state, pch, cch);
 }
 
-#define TAB_WIDTH 8
-
-static INT ExpandTabLength(LPCTSTR line)
+// Normalizes the line in a pass: the tabs are expanded unless /T, and the
+// spaces are trimmed and each run of them is compressed to its first one if
+// /W. The result is written to pszNew and/or hashed into *state, so that the
+// lines are written out only to be shown or to be compared as strings.
+// Returns the length of the result.
+static DWORD
+NormalizeLine(DWORD dwFlags, LPCTSTR pch, DWORD cch, LPTSTR pszNew, HASH_STATE *state)
 {
-    LPCTSTR pch;
-    INT cch = 0;
-    for (pch = line; *pch; ++pch)
+    LPCTSTR pchEnd = pch + cch;
+    DWORD cchNew = 0, cchRun;
+
+    if ((dwFlags & (FLAG_T | FLAG_W)) == FLAG_T)
     {
-        if (*pch == TEXT('\t'))
-            cch += TAB_WIDTH - (cch % TAB_WIDTH);
-        else
-            ++cch;
+        PutChars(pszNew, 0, state, pch, cch);
+        return cch;
     }
-    return cch;
-}
 
-static LPTSTR ExpandTab(LPCTSTR line)
-{
-    INT spaces, cch = ExpandTabLength(line), ich;
-    LPTSTR pszNew = malloc((cch + 1) * sizeof(TCHAR));
-    LPCTSTR pch;
-    if (!pszNew)
-        return NULL;
-    ich = 0;
-    for (pch = line; *pch; ++pch)
+    if (dwFlags & FLAG_W)
+    {
+        while (pch < pchEnd && IS_SPACE(*pch))
+            ++pch;
+        while (pchEnd > pch && IS_SPACE(pchEnd[-1]))
+            --pchEnd;
+    }
+
+    while (pch < pchEnd)
     {
-        if (*pch == TEXT('\t'))
+        for (cchRun = 0; pch + cchRun < pchEnd && !IS_NORM_CHAR(pch[cchRun], dwFlags); ++cchRun)
+            ;
+        PutChars(pszNew, cchNew, state, pch, cchRun);
+        cchNew += cchRun;
+        pch += cchRun;
+        if (pch >= pchEnd)
+            break;
+
+        if (dwFlags & FLAG_W)
         {
-            spaces = TAB_WIDTH - (ich % TAB_WIDTH);
-            while (spaces-- > 0)
-            {
-                pszNew[ich++] = TEXT(' ');
-            }
+            // the tabs would be expanded to the spaces
+            PutChars(pszNew, cchNew, state, ((dwFlags & FLAG_T) ? pch : s_szSpaces), 1);
+            ++cchNew;
+            while (pch < pchEnd && IS_SPACE(*pch))
+                ++pch;
         }
         else
         {
-            pszNew[ich++] = *pch;
+            cchRun = TAB_WIDTH - (cchNew % TAB_WIDTH);
+            PutChars(pszNew, cchNew, state, s_szSpaces, cchRun);
+            cchNew += cchRun;
+            ++pch;
         }
     }
-    pszNew[ich] = 0;
-    return pszNew;
+    return cchNew;
 }
 
-#define HASH_EOF 0xFFFFFFFF
-#define HASH_MASK 0x7FFFFFFF
-
-static DWORD GetHash(LPCTSTR psz, BOOL bIgnoreCase)
+// Mixes the bytes of a short line or a partial stripe eight at a time. The last word is padded
+// with zeros.
+static ULONGLONG HashTail(ULONGLONG hash, const BYTE *pb, DWORD cb)
 {
-    DWORD ret = 0xDEADFACE;
-    while (*psz)
+    ULONGLONG w;
+
+    for (; cb >= sizeof(w); pb += sizeof(w), cb -= sizeof(w))
+    {
+        memcpy(&w, pb, sizeof(w));
+        hash = MixWord(hash, w);
+    }
+    if (cb > 0)
     {
-        ret += (bIgnoreCase ? towupper(*psz) : *psz);
-        ret <<= 2;
-        ++psz;
+        for (w = 0; cb > 0; --cb)
+            w = (w << 8) | pb[cb - 1];
+        hash = MixWord(hash, w);
     }
-    return (ret & HASH_MASK);
+    return hash;
 }
 
-static NODE *AllocEOFNode(DWORD lineno)
+// A 64-bit hash of the normalized line. The stripes of a long line are hashed
+// in vectors, and the lanes and the rest of the line are mixed eight bytes at a
+// time. Every character affects all the bits, so that the long lines of the
+// same tail don't collide.
+static ULONGLONG GetHash(DWORD dwFlags, LPCTSTR pch, DWORD cch)
 {
-    NODE *node = AllocNode(AllocLine(NULL, 0), 0);
-    if (node == NULL)
-        return NULL;
-    node->pszComp = AllocLine(NULL, 0);
-    if (node->pszComp == NULL)
+    static PVOID volatile s_pfnHashStripes = NULL;
+    HASH_STATE state;
+    ULONGLONG hash = 0x9E3779B97F4A7C15ULL;
+    DWORD cchNew, i;
+
+    state.pfnHashStripes = (FN_HASH_STRIPES)ChooseOnce(&s_pfnHashStripes, ChooseHashStripes);
+    memcpy(state.acc, s_aHashKeys, sizeof(state.acc));
+    state.ich = 0;
+    state.pchTail = NULL;
+    state.bLong = FALSE;
+    state.bIgnoreCase = !!(dwFlags & FLAG_C);
+    cchNew = NormalizeLine(dwFlags, pch, cch, NULL, &state);
+
+    if (state.bLong)
     {
-        DeleteNode(node);
-        return NULL;
+        for (i = 0; i < HASH_LANES; ++i)
+            hash = MixWord(hash, state.acc[i]);
     }
-    node->lineno = lineno;
-    node->hash = HASH_EOF;
-    return node;
-}
+    if (state.pchTail)
+        hash = HashTail(hash, (const BYTE *)state.pchTail, state.cchTail * sizeof(TCHAR));
+    else
+        hash = HashTail(hash, (const BYTE *)state.ach, state.ich * sizeof(TCHAR));
 
-static __inline BOOL IsEOFNode(NODE *node)
-{
-    return !node || node->hash == HASH_EOF;
+    // the finalizer of MurmurHash3
+    hash ^= cchNew;
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ULL;
+    hash ^= hash >> 33;
+    return hash;
 }
 
-static BOOL ConvertNode(const FILECOMPARE *pFC, NODE *node)
+// The normalized line. It is written to the buffer unless the normalization
+// is nothing. NULL if out of memory.
+static LPCTSTR
+GetLineText(FILECOMPARE *pFC, INT iBuffer, DWORD dwFlags, LPCTSTR pch, DWORD cch, DWORD *pcch)
 {
-    if (!(pFC->dwFlags & FLAG_T))
+    TEXT_BUFFER *buffer = &pFC->buffer[iBuffer];
+    LPTSTR pszNew;
+    DWORD cchNew;
+
+    if ((dwFlags & (FLAG_T | FLAG_W)) == FLAG_T)
     {
-        LPTSTR tmp = ExpandTab(node->pszLine);
-        if (!tmp)
-            return FALSE;
-        free(node->pszLine);
-        node->pszLine = tmp;
-        if (!(pFC->dwFlags & FLAG_W))
-            node->hash = GetHash(node->pszLine, !!(pFC->dwFlags & FLAG_C));
+        *pcch = cch;
+        return pch;
     }
-    if (pFC->dwFlags & FLAG_W)
+
+    cchNew = NormalizeLine(dwFlags, pch, cch, NULL, NULL);
+    if (cchNew >= buffer->cchMax)
     {
-        node->pszComp = CompressSpace(node->pszLine);
-        if (!node->pszComp)
-            return FALSE;
-        node->hash = GetHash(node->pszComp, !!(pFC->dwFlags & FLAG_C));
+        pszNew = realloc(buffer->pch, max(cchNew + 1, 2 * buffer->cchMax) * sizeof(TCHAR));
+        if (!pszNew)
+            return NULL;
+        buffer->pch = pszNew;
+        buffer->cchMax = max(cchNew + 1, 2 * buffer->cchMax);
     }
-    return TRUE;
+    *pcch = NormalizeLine(dwFlags, pch, cch, buffer->pch, NULL);
+    return buffer->pch;
 }
 
-static FCRET CompareNode(const FILECOMPARE *pFC, const NODE *node0, const NODE *node1)
+// The table is a list of chunks of parallel arrays. It grows a chunk at a
+// time, so the lines already added never move. The chunks outlive the views,
+// so that they are freed by ReleaseLines instead of the arenas.
+static BOOL StoreLine(LINES *lines, const LINE *line)
 {
-    DWORD dwCmpFlags;
-    LPTSTR psz0, psz1;
-    INT ret;
-    if (node0->hash != node1->hash)
-        return FCRET_DIFFERENT;
-
-    psz0 = (pFC->dwFlags & FLAG_W) ? node0->pszComp : node0->pszLine;
-    psz1 = (pFC->dwFlags & FLAG_W) ? node1->pszComp : node1->pszLine;
-    dwCmpFlags = ((pFC->dwFlags & FLAG_C) ? NORM_IGNORECASE : 0);
-    ret = CompareString(LOCALE_USER_DEFAULT, dwCmpFlags, psz0, -1, psz1, -1);
-    return (ret == CSTR_EQUAL) ? FCRET_IDENTICAL : FCRET_DIFFERENT;
-}
+    LINE_CHUNK **chunks, *chunk;
+    DWORD i = lines->cLines & LINE_CHUNK_MASK;
 
-static BOOL FindNextLine(LPCTSTR pch, DWORD ich, DWORD cch, LPDWORD pich)
-{
-    while (ich < cch)
+    if (i == 0)
     {
-        if (pch[ich] == TEXT('\n') || pch[ich] == TEXT('\0'))
+        if (lines->cChunks >= lines->cChunkSlots)
         {
-            *pich = ich;
-            return TRUE;
+            chunks = realloc(lines->chunks, max(16, lines->cChunkSlots * 2) * sizeof(LINE_CHUNK *));
+            if (!chunks)
+                return FALSE;
+            lines->chunks = chunks;
+            lines->cChunkSlots = max(16, lines->cChunkSlots * 2);
         }
-        ++ich;
+        chunk = malloc(sizeof(LINE_CHUNK));
+        if (!chunk)
+            return FALSE;
+        STATS_ADD(cAllocs, 1);
+        lines->chunks[lines->cChunks++] = chunk;
     }
-    *pich = cch;
-    return FALSE;
+
+    chunk = lines->chunks[lines->cLines >> LINE_CHUNK_SHIFT];
+    chunk->id[i] = line->id;
+    chunk->cch[i] = line->cch;
+    chunk->pch[i] = line->pch;
+    ++lines->cLines;
+    return TRUE;
 }
 
-static FCRET
-ParseLines(const FILECOMPARE *pFC, HANDLE *phMapping,
-           LARGE_INTEGER *pib, const LARGE_INTEGER *pcb, struct list *list)
+#define LINE_CHUNK(lines, i) ((lines)->chunks[(i) >> LINE_CHUNK_SHIFT])
+#define LINE_ID(lines, i) (LINE_CHUNK(lines, i)->id[(i) & LINE_CHUNK_MASK])
+#define LINE_PCH(lines, i) ((LPCTSTR)LINE_CHUNK(lines, i)->pch[(i) & LINE_CHUNK_MASK])
+#define LINE_CCH(lines, i) (LINE_CHUNK(lines, i)->cch[(i) & LINE_CHUNK_MASK])
+#define LINENO(i) ((i) + 1)
+
+static BOOL AddEOFLine(LINES *lines)
 {
-    DWORD lineno = 1, ich, cch, ichNext, cbView, cchNode;
-    LPTSTR psz, pszLine;
-    BOOL fLast, bCR;
-    NODE *node;
+    LINE line = { TEXT(""), 0, ID_EOF, 0 };
+    return StoreLine(lines, &line);
+}
 
-    if (*phMapping == NULL)
-        return FCRET_NO_MORE_DATA;
+// The index past the end is the same as NULL of a list
+static __inline BOOL IsEOFLine(const LINES *lines, DWORD i)
+{
+    return i >= lines->cLines || LINE_ID(lines, i) == ID_EOF;
+}
 
-    if (pib->QuadPart >= pcb->QuadPart)
-    {
-        CloseHandle(*phMapping);
-        *phMapping = NULL;
-        return FCRET_NO_MORE_DATA;
-    }
+#define ASCII_UPPER(ch) \
+    (((ch) >= TEXT('a') && (ch) <= TEXT('z')) ? (ch) - (TEXT('a') - TEXT('A')) : (ch))
 
-    cbView = (DWORD)min(pcb->QuadPart - pib->QuadPart, MAX_VIEW_SIZE);
-    psz = MapViewOfFile(*phMapping, FILE_MAP_READ, pib->HighPart, pib->LowPart, cbView);
-    if (!psz)
+// /ORD compares the code units. /C ignores the case of the ASCII letters only.
+static BOOL
+IsSameOrdinal(const FILECOMPARE *pFC, LPCTSTR pch0, DWORD cch0, LPCTSTR pch1, DWORD cch1)
+{
+    DWORD ich;
+
+    if (cch0 != cch1)
+        return FALSE;
+    if (!(pFC->dwFlags & FLAG_C))
+        return memcmp(pch0, pch1, cch0 * sizeof(TCHAR)) == 0;
+    for (ich = 0; ich < cch0; ++ich)
     {
-        return OutOfMemory();
+        if (ASCII_UPPER(pch0[ich]) != ASCII_UPPER(pch1[ich]))
+            return FALSE;
     }
+    return TRUE;
+}
+
+// The sort key of the text ignoring the cases. Two texts have the same key if
+// CompareString finds them equal, so that each line is mapped only once.
+// The key is kept by the class, so that it is allocated on the heap.
+static const BYTE *GetSortKey(LPCTSTR pch, DWORD cch)
+{
+    LPBYTE pb;
+    INT cb;
 
-    ich = 0;
-    cch = cbView / sizeof(TCHAR);
-    fLast = (pib->QuadPart + cbView >= pcb->QuadPart);
-    while (ich < cch &&
-           (FindNextLine(psz, ich, cch, &ichNext) ||
-            (ichNext == cch && (fLast || ich == 0))))
+    if (cch == 0)
+        return calloc(1, 1);
+    cb = LCMapString(LOCALE_USER_DEFAULT, LCMAP_SORTKEY | NORM_IGNORECASE, pch, cch, NULL, 0);
+    if (cb <= 0)
+        return NULL;
+    pb = malloc(cb);
+    if (pb &&
+        LCMapString(LOCALE_USER_DEFAULT, LCMAP_SORTKEY | NORM_IGNORECASE,
+                    pch, cch, (LPTSTR)pb, cb) != cb)
     {
-        bCR = (ichNext > 0) && (psz[ichNext - 1] == TEXT('\r'));
-        cchNode = ichNext - ich - bCR;
-        pszLine = AllocLine(&psz[ich], cchNode);
-        node = AllocNode(pszLine, lineno++);
-        if (!node || !ConvertNode(pFC, node))
-        {
-            DeleteNode(node);
-            UnmapViewOfFile(psz);
-            return OutOfMemory();
-        }
-        list_add_tail(list, &node->entry);
-        ich = ichNext + 1;
+        free(pb);
+        pb = NULL;
     }
+    return pb;
+}
 
-    UnmapViewOfFile(psz);
-
-    pib->QuadPart += ichNext * sizeof(WCHAR);
+// Whether the line belongs to the class. Reached only if the hashes are the
+// same. The key of the line is made at most once and returned in *ppbKey.
+static FCRET
+IsInClass(FILECOMPARE *pFC, DWORD id, LPCTSTR pch, DWORD cch, const BYTE **ppbKey)
+{
+    INTERN_CLASS *cls = &pFC->intern.classes[id];
+    INT iLast = (cls->iLast[0] != NO_LINE) ? 0 : 1;
+    const LINES *lines = &pFC->lines[iLast];
+    DWORD iLine = cls->iLast[iLast];
+    DWORD cchLast = LINE_CCH(lines, iLine);
+    LPCTSTR pchLast = LINE_PCH(lines, iLine);
+    BOOL bEqual;
 
-    if (pib->QuadPart < pcb->QuadPart)
+    // the same bytes are the same after the normalization
+    if (cchLast == cch && memcmp(pchLast, pch, cch * sizeof(TCHAR)) == 0)
         return FCRET_IDENTICAL;
 
-    // append EOF node
-    node = AllocEOFNode(lineno);
-    if (!node)
-        return OutOfMemory();
-    list_add_tail(list, &node->entry);
-
-    return FCRET_NO_MORE_DATA;
-}
+    pchLast = GetLineText(pFC, 1, pFC->dwFlags, pchLast, cchLast, &cchLast);
+    pch = GetLineText(pFC, 0, pFC->dwFlags, pch, cch, &cch);
+    if (!pchLast || !pch)
+        return FCRET_INVALID;
 
-static VOID
-ShowDiff(FILECOMPARE *pFC, INT i, struct list *begin, struct list *end)
-{
-    NODE* node;
-    struct list *list = &pFC->list[i];
-    struct list *first = NULL, *last = NULL;
-    PrintCaption(pFC->file[i]);
-    if (begin && end && list_prev(list, begin))
-        begin = list_prev(list, begin);
-    while (begin != end)
+    if (cchLast == cch && memcmp(pchLast, pch, cch * sizeof(TCHAR)) == 0)
     {
-        node = LIST_ENTRY(begin, NODE, entry);
-        if (IsEOFNode(node))
-            break;
-        if (!first)
-            first = begin;
-        last = begin;
-        if (!(pFC->dwFlags & FLAG_A))
-            PrintLine(pFC, node->lineno, node->pszLine);
-        begin = list_next(list, begin);
+        bEqual = TRUE;
     }
-    if ((pFC->dwFlags & FLAG_A) && first)
+    else if (pFC->dwFlags & FLAG_ORD)
     {
-        node = LIST_ENTRY(first, NODE, entry);
-        PrintLine(pFC, node->lineno, node->pszLine);
-        first = list_next(list, first);
-        if (first != last)
+        bEqual = IsSameOrdinal(pFC, pchLast, cchLast, pch, cch);
+    }
+    else if (!(pFC->dwFlags & FLAG_C))
+    {
+        bEqual = (CompareString(LOCALE_USER_DEFAULT, 0, pchLast, cchLast,
+                                pch, cch) == CSTR_EQUAL);
+    }
+    else
+    {
+        if (!cls->pbKey)
+            cls->pbKey = GetSortKey(pchLast, cchLast);
+        if (!*ppbKey)
+            *ppbKey = GetSortKey(pch, cch);
+        if (!cls->pbKey || !*ppbKey) // not mappable
         {
-            if (list_next(list, first) == last)
-            {
-                node = LIST_ENTRY(first, NODE, entry);
-                PrintLine(pFC, node->lineno, node->pszLine);
-            }
-            else
-            {
-                PrintDots();
-            }
+            bEqual = (CompareString(LOCALE_USER_DEFAULT, NORM_IGNORECASE, pchLast, cchLast,
+                                    pch, cch) == CSTR_EQUAL);
+        }
+        else
+        {
+            bEqual = (strcmp((LPCSTR)cls->pbKey, (LPCSTR)*ppbKey) == 0);
         }
-        node = LIST_ENTRY(last, NODE, entry);
-        PrintLine(pFC, node->lineno, node->pszLine);
     }
+    return bEqual ? FCRET_IDENTICAL : FCRET_DIFFERENT;
 }
 
-static VOID
-SkipIdentical(FILECOMPARE *pFC, struct list **pptr0, struct list **pptr1)
+static BOOL GrowIntern(INTERN *intern)
 {
-    struct list *ptr0 = *pptr0, *ptr1 = *pptr1;
-    while (ptr0 && ptr1)
+    INTERN_SLOT *slots;
+    INTERN_CLASS *classes;
+    DWORD cSlots = max(1024, intern->cSlots * 2), iSlot, iNew;
+
+    if (!intern->idFree && intern->cClasses + 1 >= intern->cClassSlots)
     {
-        NODE *node0 = LIST_ENTRY(ptr0, NODE, entry);
-        NODE *node1 = LIST_ENTRY(ptr1, NODE, entry);
-        if (CompareNode(pFC, node0, node1) != FCRET_IDENTICAL)
-            break;
-        ptr0 = list_next(&pFC->list[0], ptr0);
-        ptr1 = list_next(&pFC->list[1], ptr1);
+        classes = realloc(intern->classes,
+                          max(1024, intern->cClassSlots * 2) * sizeof(INTERN_CLASS));
+        if (!classes)
+            return FALSE;
+        intern->classes = classes;
+        intern->cClassSlots = max(1024, intern->cClassSlots * 2);
     }
-    *pptr0 = ptr0;
-    *pptr1 = ptr1;
-}
+    if (2 * (intern->cUsed + 1) <= intern->cSlots)
+        return TRUE;
 
-static DWORD
-SkipIdenticalN(FILECOMPARE *pFC, struct list **pptr0, struct list **pptr1,
-               DWORD nnnn, DWORD lineno0, DWORD lineno1)
-{
-    struct list *ptr0 = *pptr0, *ptr1 = *pptr1;
-    DWORD count = 0;
-    while (ptr0 && ptr1)
+    slots = calloc(cSlots, sizeof(INTERN_SLOT));
+    if (!slots)
+        return FALSE;
+    for (iSlot = 0; iSlot < intern->cSlots; ++iSlot)
     {
-        NODE *node0 = LIST_ENTRY(ptr0, NODE, entry);
-        NODE *node1 = LIST_ENTRY(ptr1, NODE, entry);
-        if (node0->lineno >= lineno0)
-            break;
-        if (node1->lineno >= lineno1)
-            break;
-        if (CompareNode(pFC, node0, node1) != FCRET_IDENTICAL)
-            break;
-        ptr0 = list_next(&pFC->list[0], ptr0);
-        ptr1 = list_next(&pFC->list[1], ptr1);
-        ++count;
-        if (count >= nnnn)
-            break;
+        if (!intern->slots[iSlot].id)
+            continue;
+        iNew = intern->slots[iSlot].hash & (cSlots - 1);
+        while (slots[iNew].id)
+            iNew = (iNew + 1) & (cSlots - 1);
+        slots[iNew] = intern->slots[iSlot];
     }
-    *pptr0 = ptr0;
-    *pptr1 = ptr1;
-    return count;
+    free(intern->slots);
+    intern->slots = slots;
+    intern->cSlots = cSlots;
+    return TRUE;
 }
 
-static FCRET
-ScanDiff(FILECOMPARE *pFC, struct list **pptr0, struct list **pptr1,
-         DWORD lineno0, DWORD lineno1)
+// Forgets the class. The later slots of the cluster are moved back, so that
+// the probing finds them without the tombstones.
+static VOID RemoveClass(INTERN *intern, DWORD id)
 {
-    struct list *ptr0 = *pptr0, *ptr1 = *pptr1, *tmp0, *tmp1;
-    NODE *node0, *node1;
-    INT count;
-    while (ptr0 && ptr1)
+    INTERN_CLASS *cls = &intern->classes[id];
+    DWORD mask = intern->cSlots - 1, iSlot, iNext, iHome;
+
+    for (iSlot = cls->hash & mask; intern->slots[iSlot].id != id; iSlot = (iSlot + 1) & mask)
+        ;
+    for (iNext = (iSlot + 1) & mask; intern->slots[iNext].id; iNext = (iNext + 1) & mask)
     {
-        node0 = LIST_ENTRY(ptr0, NODE, entry);
-        node1 = LIST_ENTRY(ptr1, NODE, entry);
-        if (node0->lineno >= lineno0)
-            return FCRET_DIFFERENT;
-        if (node1->lineno >= lineno1)
-            return FCRET_DIFFERENT;
-        tmp0 = ptr0;
-        tmp1 = ptr1;
-        count = SkipIdenticalN(pFC, &tmp0, &tmp1, pFC->nnnn, lineno0, lineno1);
-        if (count >= pFC->nnnn)
-            break;
-        if (count > 0)
-        {
-            ptr0 = tmp0;
-            ptr1 = tmp1;
-        }
-        else
+        // the slot stays if its home is cyclically in (iSlot, iNext]
+        iHome = intern->slots[iNext].hash & mask;
+        if ((iSlot < iNext) ? (iSlot < iHome && iHome <= iNext) :
+                              (iSlot < iHome || iHome <= iNext))
         {
-            ptr0 = list_next(&pFC->list[0], ptr0);
-            ptr1 = list_next(&pFC->list[1], ptr1);
+            continue;
         }
+        intern->slots[iSlot] = intern->slots[iNext];
+        iSlot = iNext;
     }
-    *pptr0 = ptr0;
-    *pptr1 = ptr1;
-    return FCRET_IDENTICAL;
+    intern->slots[iSlot].id = 0;
+
+    free((LPVOID)cls->pbKey);
+    cls->pbKey = NULL;
+    cls->hash = intern->idFree;
+    intern->idFree = id;
+    --intern->cUsed;
 }
 
-static FCRET
-Resync(FILECOMPARE *pFC, struct list **pptr0, struct list **pptr1)
+// Gives the line the ID of its class of the equal lines. Both files share the
+// classes, so that comparing two lines is comparing two IDs. The texts are
+// compared only if the hashes are the same but the bytes are not.
+static BOOL InternLine(FILECOMPARE *pFC, INT iFile, LINE *line)
 {
+    INTERN *intern = &pFC->intern;
+    const LINES *other = &pFC->lines[!iFile];
+    INTERN_SLOT *slot;
+    INTERN_CLASS *cls;
+    LPCTSTR pch = line->pch;
+    const BYTE *pbKey = NULL;
+    DWORD cch = line->cch, iSlot, iLine, hash, id;
+    ULONGLONG hash64;
     FCRET ret;
-    struct list *ptr0, *ptr1, *save0 = NULL, *save1 = NULL;
-    NODE *node0, *node1;
-    struct list *list0 = &pFC->list[0], *list1 = &pFC->list[1];
-    DWORD lineno0, lineno1;
-    INT penalty, i0, i1, min_penalty = MAXLONG;
-
-    node0 = LIST_ENTRY(*pptr0, NODE, entry);
-    node1 = LIST_ENTRY(*pptr1, NODE, entry);
-    lineno0 = node0->lineno + pFC->n;
-    lineno1 = node1->lineno + pFC->n;
 
-    // ``If the files that you are comparing have more than pFC->n consecutive
-    //   differing lines, FC cancels the comparison,,
-    // ``If the number of matching lines in the files is less than pFC->nnnn,
-    //   FC displays the matching lines as differences,,
-    for (ptr1 = list_next(list1, *pptr1), i1 = 0; ptr1; ptr1 = list_next(list1, ptr1), ++i1)
+    // Mostly the line is the same as the line after the last match in the
+    // other file. Then neither the hash nor the lookup is needed.
+    iLine = intern->iNext[iFile];
+    if (iLine >= other->iFirst && iLine < other->cLines && LINE_ID(other, iLine) != ID_EOF)
     {
-        node1 = LIST_ENTRY(ptr1, NODE, entry);
-        if (node1->lineno >= lineno1)
-            break;
-        for (ptr0 = list_next(list0, *pptr0), i0 = 0; ptr0; ptr0 = list_next(list0, ptr0), ++i0)
+        if (LINE_CCH(other, iLine) == cch &&
+            memcmp(LINE_PCH(other, iLine), pch, cch * sizeof(TCHAR)) == 0)
         {
-            node0 = LIST_ENTRY(ptr0, NODE, entry);
-            if (node0->lineno >= lineno0)
-                break;
-            if (CompareNode(pFC, node0, node1) == FCRET_IDENTICAL)
-            {
-                penalty = min(i0, i1) + abs(i1 - i0);
-                if (min_penalty > penalty)
-                {
-                    min_penalty = penalty;
-                    save0 = ptr0;
-                    save1 = ptr1;
-                }
-            }
+            line->id = LINE_ID(other, iLine);
+            intern->classes[line->id].iLast[iFile] = pFC->lines[iFile].cLines;
+            intern->iNext[iFile] = iLine + 1;
+            return TRUE;
         }
     }
 
-    if (save0 && save1)
+    if ((2 * (intern->cUsed + 1) > intern->cSlots ||
+         (!intern->idFree && intern->cClasses + 1 >= intern->cClassSlots)) &&
+        !GrowIntern(intern))
     {
-        *pptr0 = save0;
-        *pptr1 = save1;
-        ret = ScanDiff(pFC, &save0, &save1, lineno0, lineno1);
-        if (save0 && save1)
+        return FALSE;
+    }
+
+    hash64 = (line->hash ? line->hash : GetHash(pFC->dwFlags, pch, cch));
+    hash = (DWORD)(hash64 ^ (hash64 >> 32));
+    for (iSlot = hash & (intern->cSlots - 1); intern->slots[iSlot].id;
+         iSlot = (iSlot + 1) & (intern->cSlots - 1))
+    {
+        slot = &intern->slots[iSlot];
+        if (slot->hash != hash)
         {
-            *pptr0 = save0;
-            *pptr1 = save1;
+            STATS_ADD(cHashRejects, 1);
+            continue;
         }
-        return ret;
+        STATS_ADD(cTextCompares, 1);
+        ret = IsInClass(pFC, slot->id, pch, cch, &pbKey);
+        if (ret == FCRET_INVALID)
+        {
+            free((LPVOID)pbKey);
+            return FALSE;
+        }
+        if (ret == FCRET_DIFFERENT)
+            continue;
+
+        cls = &intern->classes[slot->id];
+        if (cls->iLast[!iFile] != NO_LINE)
+            intern->iNext[iFile] = cls->iLast[!iFile] + 1;
+        cls->iLast[iFile] = pFC->lines[iFile].cLines;
+        line->id = slot->id;
+        free((LPVOID)pbKey);
+        return TRUE;
     }
 
-    for (ptr0 = *pptr0; ptr0; ptr0 = list_next(list0, ptr0))
+    // a new class of the line to be stored next
+    if (intern->idFree)
     {
-        node0 = LIST_ENTRY(ptr0, NODE, entry);
-        if (node0->lineno == lineno0)
-            break;
+        id = intern->idFree;
+        intern->idFree = intern->classes[id].hash;
     }
-    for (ptr1 = *pptr1; ptr1; ptr1 = list_next(list1, ptr1))
+    else
     {
-        node1 = LIST_ENTRY(ptr1, NODE, entry);
-        if (node1->lineno == lineno1)
-            break;
+        id = ++intern->cClasses;
     }
-    *pptr0 = ptr0;
-    *pptr1 = ptr1;
+    cls = &intern->classes[id];
+    cls->iLast[iFile] = pFC->lines[iFile].cLines;
+    cls->iLast[!iFile] = NO_LINE;
+    cls->hash = hash;
+    cls->pbKey = pbKey;
+    slot = &intern->slots[iSlot];
+    slot->hash = hash;
+    slot->id = id;
+    ++intern->cUsed;
+    line->id = id;
+    return TRUE;
+}
+
+static VOID FreeIntern(INTERN *intern)
+{
+    DWORD id;
+    for (id = 1; id <= intern->cClasses; ++id)
+        free((LPVOID)intern->classes[id].pbKey);
+    free(intern->classes);
+    free(intern->slots);
+    ZeroMemory(intern, sizeof(*intern));
+}
+
+static __inline FCRET CompareLine(const FILECOMPARE *pFC, DWORD i0, DWORD i1)
+{
+    if (LINE_ID(&pFC->lines[0], i0) == LINE_ID(&pFC->lines[1], i1))
+        return FCRET_IDENTICAL;
     return FCRET_DIFFERENT;
 }
 
-static FCRET 
-Finalize(FILECOMPARE* pFC, struct list *ptr0, struct list* ptr1, BOOL fDifferent)
+// The ends of the lines are found in batches. An end is the index of '\n' or
+// '\0'. The views and the buffers are smaller than 2 GB, so that the top bit
+// can tell whether the end is preceded by '\r'.
+#define LINE_END_CR 0x80000000
+#define LINE_END_BATCH 1024
+
+typedef DWORD (*FN_FIND_LINE_ENDS)(LPCTSTR pch, DWORD ich, DWORD cch,
+                                   DWORD *pichEnds, DWORD cMax, DWORD *pichNext);
+
+// The length of the line from ich to the end without '\r'
+#define LINE_END_CCH(ich, ichEnd) \
+    (((ichEnd) & ~LINE_END_CR) - (ich) - (((ichEnd) & LINE_END_CR) ? 1 : 0))
+
+static __inline DWORD TrimCR(LPCTSTR pch, DWORD cch)
+{
+    if (cch > 0 && pch[cch - 1] == TEXT('\r'))
+        --cch;
+    return cch;
+}
+
+// Stores the ends of the 64 characters at ich. Bit j of crs is set if the
+// character before #j is '\r'.
+static __inline DWORD
+StoreLineEnds(DWORD *pichEnds, DWORD ich, ULONGLONG ends, ULONGLONG crs)
 {
-    if (!ptr0 && !ptr1)
+    DWORD c = 0, j;
+    while (ends)
     {
-        if (fDifferent)
-            return Different(pFC->file[0], pFC->file[1]);
-        return NoDifference();
+        j = LowestBit64(ends);
+        pichEnds[c++] = (ich + j) | (((crs >> j) & 1) ? LINE_END_CR : 0);
+        ends &= ends - 1;
     }
-    else
+    return c;
+}
+
+// Stores at most cMax ends from pch[ich] and returns the # of them.
+// *pichNext receives where the next call should continue.
+static DWORD
+FindLineEndsScalar(LPCTSTR pch, DWORD ich, DWORD cch, DWORD *pichEnds, DWORD cMax, DWORD *pichNext)
+{
+    DWORD c = 0;
+    for (; ich < cch && c < cMax; ++ich)
     {
-        ShowDiff(pFC, 0, ptr0, NULL);
-        ShowDiff(pFC, 1, ptr1, NULL);
-        PrintEndOfDiff();
-        return FCRET_DIFFERENT;
+        if (pch[ich] == TEXT('\n') || pch[ich] == TEXT('\0'))
+        {
+            pichEnds[c++] =
+                ich | ((ich > 0 && pch[ich - 1] == TEXT('\r')) ? LINE_END_CR : 0);
+        }
     }
+    *pichNext = ich;
+    return c;
 }
 
-FCRET TextCompare(FILECOMPARE *pFC, HANDLE *phMapping0, const LARGE_INTEGER *pcb0,
-                                    HANDLE *phMapping1, const LARGE_INTEGER *pcb1)
+#ifdef FC_X86
+// The masks of the ends and of '\r' in the 16 characters at pch
+TARGET_SSE2
+static __inline VOID LineMasksSSE2(LPCTSTR pch, DWORD *pdwEnds, DWORD *pdwCRs)
 {
-    FCRET ret, ret0, ret1;
-    struct list *ptr0, *ptr1, *save0, *save1, *next0, *next1;
-    NODE* node0, * node1;
-    BOOL fDifferent = FALSE;
-    LARGE_INTEGER ib0 = { .QuadPart = 0 }, ib1 = { .QuadPart = 0 };
-    struct list *list0 = &pFC->list[0], *list1 = &pFC->list[1];
-    list_init(list0);
-    list_init(list1);
+#ifdef UNICODE
+    const __m128i nl = _mm_set1_epi16(L'\n'), cr = _mm_set1_epi16(L'\r');
+    const __m128i zero = _mm_setzero_si128();
+    __m128i x0 = _mm_loadu_si128((const __m128i *)pch);
+    __m128i x1 = _mm_loadu_si128((const __m128i *)&pch[8]);
+    // the compares are 0 or -1, so that packing keeps one byte per character
+    *pdwEnds = (DWORD)_mm_movemask_epi8(_mm_packs_epi16(
+        _mm_or_si128(_mm_cmpeq_epi16(x0, nl), _mm_cmpeq_epi16(x0, zero)),
+        _mm_or_si128(_mm_cmpeq_epi16(x1, nl), _mm_cmpeq_epi16(x1, zero))));
+    *pdwCRs = (DWORD)_mm_movemask_epi8(_mm_packs_epi16(_mm_cmpeq_epi16(x0, cr),
+                                                       _mm_cmpeq_epi16(x1, cr)));
+#else
+    const __m128i nl = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+    const __m128i zero = _mm_setzero_si128();
+    __m128i x = _mm_loadu_si128((const __m128i *)pch);
+    *pdwEnds = (DWORD)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, nl),
+                                                     _mm_cmpeq_epi8(x, zero)));
+    *pdwCRs = (DWORD)_mm_movemask_epi8(_mm_cmpeq_epi8(x, cr));
+#endif
+}
 
-    do
+TARGET_SSE2
+static DWORD
+FindLineEndsSSE2(LPCTSTR pch, DWORD ich, DWORD cch, DWORD *pichEnds, DWORD cMax, DWORD *pichNext)
+{
+    ULONGLONG ends, crs, crLast = (ich > 0 && pch[ich - 1] == TEXT('\r'));
+    DWORD c = 0, i, dwEnds, dwCRs;
+
+    // 64 characters at a time while their ends surely fit
+    for (; ich + 64 <= cch && cMax - c >= 64; ich += 64)
     {
-        ret0 = ParseLines(pFC, phMapping0, &ib0, pcb0, list0);
-        if (ret0 == FCRET_INVALID)
-        {
-            ret = ret0;
-            goto cleanup;
-        }
-        ret1 = ParseLines(pFC, phMapping1, &ib1, pcb1, list1);
-        if (ret1 == FCRET_INVALID)
+        ends = crs = 0;
+        for (i = 0; i < 64; i += 16)
         {
-            ret = ret1;
-            goto cleanup;
+            LineMasksSSE2(&pch[ich + i], &dwEnds, &dwCRs);
+            ends |= (ULONGLONG)dwEnds << i;
+            crs |= (ULONGLONG)dwCRs << i;
         }
+        if (ends)
+            c += StoreLineEnds(&pichEnds[c], ich, ends, (crs << 1) | crLast);
+        crLast = crs >> 63;
+    }
 
-        ptr0 = list_head(list0);
-        ptr1 = list_head(list1);
-        for (;;)
-        {
-            if (!ptr0 || !ptr1)
-                goto quit;
+    return c + FindLineEndsScalar(pch, ich, cch, &pichEnds[c], cMax - c, pichNext);
+}
 
-            // skip identical (sync'ed)
-            SkipIdentical(pFC, &ptr0, &ptr1);
-            if (ptr0 || ptr1)
-                fDifferent = TRUE;
-            node0 = LIST_ENTRY(ptr0, NODE, entry);
-            node1 = LIST_ENTRY(ptr1, NODE, entry);
-            if (IsEOFNode(node0) || IsEOFNode(node1))
-                goto quit;
+// The masks of the ends and of '\r' in the 32 characters at pch
+TARGET_AVX2
+static __inline VOID LineMasksAVX2(LPCTSTR pch, DWORD *pdwEnds, DWORD *pdwCRs)
+{
+#ifdef UNICODE
+    const __m256i nl = _mm256_set1_epi16(L'\n'), cr = _mm256_set1_epi16(L'\r');
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i x0 = _mm256_loadu_si256((const __m256i *)pch);
+    __m256i x1 = _mm256_loadu_si256((const __m256i *)&pch[16]);
+    // packing works in each 128-bit lane. The permutation restores the order.
+    __m256i ends = _mm256_packs_epi16(
+        _mm256_or_si256(_mm256_cmpeq_epi16(x0, nl), _mm256_cmpeq_epi16(x0, zero)),
+        _mm256_or_si256(_mm256_cmpeq_epi16(x1, nl), _mm256_cmpeq_epi16(x1, zero)));
+    __m256i crs = _mm256_packs_epi16(_mm256_cmpeq_epi16(x0, cr), _mm256_cmpeq_epi16(x1, cr));
+    *pdwEnds = (DWORD)_mm256_movemask_epi8(_mm256_permute4x64_epi64(ends, 0xD8));
+    *pdwCRs = (DWORD)_mm256_movemask_epi8(_mm256_permute4x64_epi64(crs, 0xD8));
+#else
+    const __m256i nl = _mm256_set1_epi8('\n'), cr = _mm256_set1_epi8('\r');
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i x = _mm256_loadu_si256((const __m256i *)pch);
+    *pdwEnds = (DWORD)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(x, nl),
+                                                           _mm256_cmpeq_epi8(x, zero)));
+    *pdwCRs = (DWORD)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, cr));
+#endif
+}
 
-            // try to resync
-            save0 = ptr0;
-            save1 = ptr1;
-            ret = Resync(pFC, &ptr0, &ptr1);
-            if (ret == FCRET_INVALID)
-                goto cleanup;
-            if (ret == FCRET_DIFFERENT)
+TARGET_AVX2
+static DWORD
+FindLineEndsAVX2(LPCTSTR pch, DWORD ich, DWORD cch, DWORD *pichEnds, DWORD cMax, DWORD *pichNext)
+{
+    ULONGLONG ends, crs, crLast = (ich > 0 && pch[ich - 1] == TEXT('\r'));
+    DWORD c = 0, dwEnds0, dwCRs0, dwEnds1, dwCRs1;
+
+    for (; ich + 64 <= cch && cMax - c >= 64; ich += 64)
+    {
+        LineMasksAVX2(&pch[ich], &dwEnds0, &dwCRs0);
+        LineMasksAVX2(&pch[ich + 32], &dwEnds1, &dwCRs1);
+        ends = ((ULONGLONG)dwEnds1 << 32) | dwEnds0;
+        crs = ((ULONGLONG)dwCRs1 << 32) | dwCRs0;
+        if (ends)
+            c += StoreLineEnds(&pichEnds[c], ich, ends, (crs << 1) | crLast);
+        crLast = crs >> 63;
+    }
+
+    _mm256_zeroupper();
+    return c + FindLineEndsScalar(pch, ich, cch, &pichEnds[c], cMax - c, pichNext);
+}
+#endif /* def FC_X86 */
+
+static PVOID ChooseFindLineEnds(VOID)
+{
+#ifdef FC_X86
+    DWORD dwFeatures = GetCpuFeatures();
+    if (dwFeatures & CPU_AVX2)
+        return (PVOID)FindLineEndsAVX2;
+    if (dwFeatures & CPU_SSE2)
+        return (PVOID)FindLineEndsSSE2;
+#endif
+    return (PVOID)FindLineEndsScalar;
+}
+
+static DWORD
+FindLineEnds(LPCTSTR pch, DWORD ich, DWORD cch, DWORD *pichEnds, DWORD cMax, DWORD *pichNext)
+{
+    static PVOID volatile s_pfnFindLineEnds = NULL;
+    FN_FIND_LINE_ENDS pfn =
+        (FN_FIND_LINE_ENDS)ChooseOnce(&s_pfnFindLineEnds, ChooseFindLineEnds);
+    return pfn(pch, ich, cch, pichEnds, cMax, pichNext);
+}
+
+// Adds a line without the terminating "\r\n". If bCopy is FALSE, the line
+// must stay valid until the block is released. The hash may be zero.
+static BOOL
+AddLine(FILECOMPARE *pFC, INT iFile, ARENA *arena, LPCTSTR pch, DWORD cch, BOOL bCopy,
+        ULONGLONG hash)
+{
+    LINE line;
+    if (bCopy)
+    {
+        pch = AllocLine(arena, pch, cch);
+        if (!pch)
+            return FALSE;
+    }
+    ZeroMemory(&line, sizeof(line));
+    line.pch = pch;
+    line.cch = cch;
+    line.hash = hash;
+    return InternLine(pFC, iFile, &line) &&
+           StoreLine(&pFC->lines[iFile], &line);
+}
+
+// Appends the text to the partial line carried over to the next block
+static BOOL CarryLine(TEXT_FILE *text, LPCTSTR pch, DWORD cch)
+{
+    LPTSTR pszNew;
+    if (text->cchCarry + cch > text->cchCarryMax)
+    {
+        pszNew = realloc(text->pCarry, max(text->cchCarry + cch, 2 * text->cchCarryMax) * sizeof(TCHAR));
+        if (!pszNew)
+            return FALSE;
+        text->pCarry = pszNew;
+        text->cchCarryMax = max(text->cchCarry + cch, 2 * text->cchCarryMax);
+    }
+    memcpy((LPTSTR)text->pCarry + text->cchCarry, pch, cch * sizeof(TCHAR));
+    text->cchCarry += cch;
+    return TRUE;
+}
+
+// Adds the line from ich to the end. The line is completed by the carried
+// text if any, and then the hash is made again.
+static BOOL
+AddLineEnd(FILECOMPARE *pFC, INT iFile, ARENA *arena, LPCTSTR psz, DWORD ich, DWORD ichEnd,
+           BOOL bCopy, ULONGLONG hash)
+{
+    TEXT_FILE *text = &pFC->text[iFile];
+
+    if (text->cchCarry == 0)
+        return AddLine(pFC, iFile, arena, &psz[ich], LINE_END_CCH(ich, ichEnd), bCopy, hash);
+
+    // its '\r' may be in the last block
+    if (!CarryLine(text, &psz[ich], (ichEnd & ~LINE_END_CR) - ich) ||
+        !AddLine(pFC, iFile, arena, text->pCarry,
+                 TrimCR(text->pCarry, text->cchCarry), TRUE, 0))
+    {
+        return FALSE;
+    }
+    text->cchCarry = 0;
+    return TRUE;
+}
+
+#define PARALLEL_TEXT_CHUNK (256 * 1024) // characters
+
+typedef struct TEXT_CHUNK
+{
+    DWORD ich, ichEnd; // the range in the block
+    DWORD *pichEnds;
+    ULONGLONG *pHashes; // the hashes of the lines to pichEnds
+    DWORD cEnds, cMax;
+    BOOL bError; // out of memory
+    HANDLE hDone; // event
+} TEXT_CHUNK;
+
+typedef struct TEXT_POOL
+{
+    DWORD dwFlags;
+    LPCTSTR psz;
+    DWORD cch;
+    LONG cChunks;
+    volatile LONG iNextChunk;
+    volatile LONG fCancel;
+    HANDLE hSlots; // semaphore of free slots
+    INT cSlots;
+    TEXT_CHUNK *chunks; // ring of cSlots
+} TEXT_POOL;
+
+// Finds the line ends in the chunk and hashes the lines. The first line may
+// begin in the last chunk, so that its hash is left zero.
+static VOID IndexChunk(const TEXT_POOL *pool, TEXT_CHUNK *chunk)
+{
+    DWORD ichScan = chunk->ich, ich, iEnd, cEnds, cMax, *pichEnds;
+    ULONGLONG *pHashes;
+
+    chunk->cEnds = 0;
+    chunk->bError = FALSE;
+    while (ichScan < chunk->ichEnd)
+    {
+        if (chunk->cMax - chunk->cEnds < LINE_END_BATCH)
+        {
+            cMax = max(2 * chunk->cMax, LINE_END_BATCH);
+            pichEnds = realloc(chunk->pichEnds, cMax * sizeof(DWORD));
+            if (pichEnds)
+                chunk->pichEnds = pichEnds;
+            pHashes = realloc(chunk->pHashes, cMax * sizeof(ULONGLONG));
+            if (pHashes)
+                chunk->pHashes = pHashes;
+            if (!pichEnds || !pHashes)
+            {
+                chunk->bError = TRUE;
+                return;
+            }
+            chunk->cMax = cMax;
+        }
+
+        cEnds = FindLineEnds(pool->psz, ichScan, chunk->ichEnd,
+                             &chunk->pichEnds[chunk->cEnds], LINE_END_BATCH, &ichScan);
+        for (iEnd = chunk->cEnds; iEnd < chunk->cEnds + cEnds; ++iEnd)
+        {
+            if (iEnd == 0)
+            {
+                chunk->pHashes[0] = 0;
+                continue;
+            }
+            ich = (chunk->pichEnds[iEnd - 1] & ~LINE_END_CR) + 1;
+            chunk->pHashes[iEnd] = GetHash(pool->dwFlags, &pool->psz[ich],
+                                           LINE_END_CCH(ich, chunk->pichEnds[iEnd]));
+        }
+        chunk->cEnds += cEnds;
+    }
+}
+
+static DWORD WINAPI TextWorkerThreadProc(LPVOID arg)
+{
+    TEXT_POOL *pool = arg;
+    LONG iChunk;
+    TEXT_CHUNK *chunk;
+
+    for (;;)
+    {
+        WaitForSingleObject(pool->hSlots, INFINITE);
+        if (pool->fCancel)
+            break;
+        iChunk = InterlockedIncrement(&pool->iNextChunk) - 1;
+        if (iChunk >= pool->cChunks)
+            break;
+
+        // the main thread has already added the lines of the last owner
+        chunk = &pool->chunks[iChunk % pool->cSlots];
+        chunk->ich = (DWORD)iChunk * PARALLEL_TEXT_CHUNK;
+        chunk->ichEnd = min(pool->cch, chunk->ich + PARALLEL_TEXT_CHUNK);
+        IndexChunk(pool, chunk);
+        SetEvent(chunk->hDone);
+    }
+    return 0;
+}
+
+// Same as IndexBlock, but the chunks of the block are indexed on a worker
+// pool. Their line ends are collected in order.
+static BOOL IndexBlockParallel(FILECOMPARE *pFC, TEXT_BLOCK *block)
+{
+    TEXT_POOL pool = { .dwFlags = pFC->dwFlags, .psz = block->pch, .cch = block->cch };
+    HANDLE hThreads[MAX_THREADS];
+    INT cThreads = 0, iSlot;
+    LONG iChunk;
+    TEXT_CHUNK *chunk;
+    DWORD cMax = 0, *pichEnds;
+    ULONGLONG *pHashes;
+    BOOL bOK = FALSE;
+
+    pool.cChunks = (LONG)((pool.cch + PARALLEL_TEXT_CHUNK - 1) / PARALLEL_TEXT_CHUNK);
+    pool.cSlots = 2 * pFC->nThreads;
+    pool.chunks = calloc(pool.cSlots, sizeof(TEXT_CHUNK));
+    pool.hSlots = CreateSemaphoreW(NULL, pool.cSlots, MAXLONG, NULL);
+    if (!pool.chunks || !pool.hSlots)
+        goto cleanup;
+    for (iSlot = 0; iSlot < pool.cSlots; ++iSlot)
+    {
+        pool.chunks[iSlot].hDone = CreateEventW(NULL, FALSE, FALSE, NULL);
+        if (!pool.chunks[iSlot].hDone)
+            goto cleanup;
+    }
+
+    for (cThreads = 0; cThreads < min(pFC->nThreads, pool.cChunks); ++cThreads)
+    {
+        hThreads[cThreads] = CreateThread(NULL, 0, TextWorkerThreadProc, &pool, 0, NULL);
+        if (!hThreads[cThreads])
+            break;
+    }
+    if (cThreads == 0)
+        goto cleanup;
+
+    // collect the line ends of the chunks in order
+    for (iChunk = 0; iChunk < pool.cChunks; ++iChunk)
+    {
+        chunk = &pool.chunks[iChunk % pool.cSlots];
+        WaitForSingleObject(chunk->hDone, INFINITE);
+        if (chunk->bError)
+            goto cleanup;
+        if (block->cEnds + chunk->cEnds > cMax)
+        {
+            cMax = max(2 * cMax, block->cEnds + chunk->cEnds);
+            pichEnds = realloc(block->pichEnds, cMax * sizeof(DWORD));
+            if (pichEnds)
+                block->pichEnds = pichEnds;
+            pHashes = realloc(block->pHashes, cMax * sizeof(ULONGLONG));
+            if (pHashes)
+                block->pHashes = pHashes;
+            if (!pichEnds || !pHashes)
+                goto cleanup;
+        }
+        CopyMemory(&block->pichEnds[block->cEnds], chunk->pichEnds, chunk->cEnds * sizeof(DWORD));
+        CopyMemory(&block->pHashes[block->cEnds], chunk->pHashes, chunk->cEnds * sizeof(ULONGLONG));
+        block->cEnds += chunk->cEnds;
+        ReleaseSemaphore(pool.hSlots, 1, NULL);
+    }
+
+    bOK = TRUE;
+
+cleanup:
+    if (cThreads > 0)
+    {
+        // wake up the workers and let them quit
+        pool.fCancel = TRUE;
+        ReleaseSemaphore(pool.hSlots, cThreads, NULL);
+        WaitForMultipleObjects(cThreads, hThreads, TRUE, INFINITE);
+        while (cThreads-- > 0)
+            CloseHandle(hThreads[cThreads]);
+    }
+    if (pool.chunks)
+    {
+        for (iSlot = 0; iSlot < pool.cSlots; ++iSlot)
+        {
+            free(pool.chunks[iSlot].pichEnds);
+            free(pool.chunks[iSlot].pHashes);
+            if (pool.chunks[iSlot].hDone)
+                CloseHandle(pool.chunks[iSlot].hDone);
+        }
+        free(pool.chunks);
+    }
+    if (pool.hSlots)
+        CloseHandle(pool.hSlots);
+    return bOK;
+}
+
+// Finds the line ends of the block and hashes the lines. This is the part of
+// the parsing that the reader thread can do before the lines are added.
+static BOOL IndexBlock(FILECOMPARE *pFC, TEXT_BLOCK *block)
+{
+    TEXT_POOL pool = { .dwFlags = pFC->dwFlags, .psz = block->pch, .cch = block->cch };
+    TEXT_CHUNK chunk = { .ich = 0, .ichEnd = block->cch };
+
+    if (pFC->nThreads > 1 && block->cch >= 2 * PARALLEL_TEXT_CHUNK)
+        return IndexBlockParallel(pFC, block);
+
+    IndexChunk(&pool, &chunk);
+    block->pichEnds = chunk.pichEnds;
+    block->pHashes = chunk.pHashes;
+    block->cEnds = chunk.cEnds;
+    return !chunk.bError;
+}
+
+// Adds the lines of a view or a buffer. The line at the end without '\n' is
+// carried over, and completed by the first line of the next block.
+static BOOL AddBlockLines(FILECOMPARE *pFC, INT iFile, TEXT_BLOCK *block)
+{
+    LPCTSTR psz = block->pch;
+    DWORD ich = 0, iEnd;
+    BOOL bOK = TRUE;
+
+    for (iEnd = 0; bOK && iEnd < block->cEnds; ++iEnd)
+    {
+        bOK = AddLineEnd(pFC, iFile, &block->arena, psz, ich, block->pichEnds[iEnd],
+                         block->bCopy, block->pHashes[iEnd]);
+        ich = (block->pichEnds[iEnd] & ~LINE_END_CR) + 1;
+    }
+    if (bOK && ich < block->cch)
+        bOK = CarryLine(&pFC->text[iFile], &psz[ich], block->cch - ich);
+
+    // the index is not needed any more
+    free(block->pichEnds);
+    free(block->pHashes);
+    block->pichEnds = NULL;
+    block->pHashes = NULL;
+    return bOK;
+}
+
+#ifdef UNICODE
+// Converts the block to UTF-16 in the arena. A character cut off by the end of
+// the block is completed by the head of the next one. bFinal flushes it.
+static LPCWSTR
+DecodeBlock(FILECOMPARE *pFC, INT iFile, ARENA *arena, const BYTE *pb, DWORD cb, BOOL bFinal,
+            DWORD *pcch)
+{
+    TEXT_FILE *text = &pFC->text[iFile];
+    ENCODING nEncoding = pFC->encoding[iFile];
+    LPWSTR psz = ArenaAlloc(arena, (text->cbPartial + cb + 1) * sizeof(WCHAR));
+    DWORD ib = 0, ich = 0, cbPartial = text->cbPartial, cbHead, cbUsed;
+
+    if (!psz)
+        return NULL;
+
+    if (cbPartial > 0)
+    {
+        // a character from the partial bytes has all of its bytes here
+        cbHead = min(cb, sizeof(text->abPartial) - cbPartial);
+        memcpy(&text->abPartial[cbPartial], pb, cbHead);
+        while (ib < cbPartial)
+        {
+            // the end of the window is not the end of the file unless it has all of the block
+            ich += DecodeText(nEncoding, &text->abPartial[ib], cbPartial + cbHead - ib,
+                              &psz[ich], bFinal && cbHead == cb, &cbUsed);
+            if (cbUsed == 0)
+                break;
+            ib += cbUsed;
+        }
+        if (ib < cbPartial) // the block is shorter than the character
+        {
+            text->cbPartial = cbPartial + cbHead - ib;
+            memmove(text->abPartial, &text->abPartial[ib], text->cbPartial);
+            *pcch = ich;
+            return psz;
+        }
+        ib -= cbPartial;
+    }
+
+    ich += DecodeText(nEncoding, &pb[ib], cb - ib, &psz[ich], bFinal, &cbUsed);
+    ib += cbUsed;
+    text->cbPartial = cb - ib;
+    memcpy(text->abPartial, &pb[ib], text->cbPartial);
+    *pcch = ich;
+    return psz;
+}
+#endif
+
+#define TEXT_READER_MIN_SIZE (1024 * 1024) // the smaller files are read on demand
+
+// Reads the next view or buffer of the file into a new block, and indexes its
+// lines. A stream buffer read ahead is copied, for the stream reuses it.
+static TEXT_BLOCK *ReadBlock(FILECOMPARE *pFC, INT iFile, BOOL bAhead)
+{
+    TEXT_FILE *text = &pFC->text[iFile];
+    STREAM *stream = pFC->stream[iFile];
+    TEXT_BLOCK *block;
+    const BYTE *pb = NULL;
+    LPVOID pView = NULL, pvCopy;
+    DWORD cb = 0, cbSkip;
+    LONGLONG t0;
+
+    block = calloc(1, sizeof(TEXT_BLOCK));
+    if (!block)
+        return NULL;
+    STATS_ADD(cAllocs, 1);
+
+    if (stream)
+    {
+        if (!StreamRead(stream, &pb, &cb))
+        {
+            block->dwError = ERROR_READ_FAULT;
+            return block;
+        }
+        block->bCopy = TRUE; // the buffers are reused
+    }
+    else if (*text->phMapping && text->ib < (ULONGLONG)text->pcb->QuadPart)
+    {
+        // the views are of the same size, so that their offsets are aligned
+        cb = (DWORD)min((ULONGLONG)text->pcb->QuadPart - text->ib, MAX_VIEW_SIZE);
+        t0 = STATS_START();
+        pView = MapViewOfFile(*text->phMapping, FILE_MAP_READ,
+                              (DWORD)(text->ib >> 32), (DWORD)text->ib, cb);
+        STATS_STOP(qpcMap, t0);
+        STATS_ADD(cViews, 1);
+        STATS_ADD(cbMapped, cb);
+        if (!pView)
+        {
+            block->dwError = ERROR_NOT_ENOUGH_MEMORY;
+            return block;
+        }
+        pb = pView;
+        text->ib += cb;
+    }
+    block->bLast = !(cb > 0 && (stream || text->ib < (ULONGLONG)text->pcb->QuadPart));
+    t0 = STATS_START(); // decoding and indexing
+
+    // the byte order mark is not a part of the first line
+    cbSkip = min(cb, text->cbSkip);
+    pb += cbSkip;
+    cb -= cbSkip;
+    text->cbSkip -= cbSkip;
+
+    block->pch = pb;
+    block->cch = cb / sizeof(TCHAR);
+#ifdef UNICODE
+    // an odd byte is decoded as in UTF-16BE: it waits for the next block, or
+    // becomes U+FFFD at the end of the file
+    if (pFC->encoding[iFile] != ENCODING_UTF16LE || (cb & 1) || text->cbPartial > 0)
+    {
+        block->pch = DecodeBlock(pFC, iFile, &block->arena, pb, cb, block->bLast, &block->cch);
+        block->bCopy = FALSE; // the text is in the arena
+        if (pView)
+        {
+            UnmapViewOfFile(pView);
+            pView = NULL;
+        }
+        if (!block->pch)
+        {
+            block->dwError = ERROR_NOT_ENOUGH_MEMORY;
+            return block;
+        }
+    }
+#endif
+
+    // the lines refer to the view
+    if (pView && !ArenaAddView(&block->arena, pView))
+    {
+        UnmapViewOfFile(pView);
+        block->dwError = ERROR_NOT_ENOUGH_MEMORY;
+        return block;
+    }
+
+    if (bAhead && block->bCopy && block->cch > 0)
+    {
+        pvCopy = ArenaAlloc(&block->arena, block->cch * sizeof(TCHAR));
+        if (!pvCopy)
+        {
+            block->dwError = ERROR_NOT_ENOUGH_MEMORY;
+            return block;
+        }
+        CopyMemory(pvCopy, block->pch, block->cch * sizeof(TCHAR));
+        block->pch = pvCopy;
+        block->bCopy = FALSE;
+    }
+
+    if (block->cch > 0 && !IndexBlock(pFC, block))
+        block->dwError = ERROR_NOT_ENOUGH_MEMORY;
+    STATS_STOP(qpcParse, t0);
+
+    if (block->bLast && *text->phMapping)
+    {
+        CloseHandle(*text->phMapping);
+        *text->phMapping = NULL;
+    }
+    return block;
+}
+
+static VOID FreeBlock(TEXT_BLOCK *block)
+{
+    ArenaFree(&block->arena);
+    free(block->pichEnds);
+    free(block->pHashes);
+    free(block);
+}
+
+// Reads the blocks ahead into the ring until the last one or an error
+static DWORD WINAPI TextReaderThreadProc(LPVOID arg)
+{
+    TEXT_FILE *text = arg;
+    TEXT_BLOCK *block;
+    INT iSlot = 0;
+
+    do
+    {
+        WaitForSingleObject(text->hFree, INFINITE);
+        if (text->fCancel)
+            break;
+        block = ReadBlock(text->pFC, text->iFile, TRUE);
+        text->ahead[iSlot] = block;
+        ReleaseSemaphore(text->hReady, 1, NULL);
+        iSlot = (iSlot + 1) % TEXT_READ_AHEAD;
+    } while (block && !block->bLast && !block->dwError);
+    return 0;
+}
+
+// Starts the reader thread of file #i. If it fails, the file is read on demand.
+static VOID StartReader(FILECOMPARE *pFC, INT iFile)
+{
+    TEXT_FILE *text = &pFC->text[iFile];
+
+    text->pFC = pFC;
+    text->iFile = iFile;
+    text->hFree = CreateSemaphoreW(NULL, TEXT_READ_AHEAD, TEXT_READ_AHEAD, NULL);
+    text->hReady = CreateSemaphoreW(NULL, 0, TEXT_READ_AHEAD, NULL);
+    if (text->hFree && text->hReady)
+        text->hThread = CreateThread(NULL, 0, TextReaderThreadProc, text, 0, NULL);
+    if (!text->hThread)
+    {
+        if (text->hFree)
+            CloseHandle(text->hFree);
+        if (text->hReady)
+            CloseHandle(text->hReady);
+        text->hFree = text->hReady = NULL;
+    }
+}
+
+// Stops the reader thread, which may be waiting for a slot or the stream, and
+// frees the blocks not taken
+static VOID StopReader(FILECOMPARE *pFC, INT iFile)
+{
+    TEXT_FILE *text = &pFC->text[iFile];
+    INT iSlot;
+
+    if (!text->hThread)
+        return;
+
+    text->fCancel = TRUE;
+    ReleaseSemaphore(text->hFree, 1, NULL);
+    if (pFC->stream[iFile])
+        StreamCancel(pFC->stream[iFile]);
+    WaitForSingleObject(text->hThread, INFINITE);
+    CloseHandle(text->hThread);
+    CloseHandle(text->hFree);
+    CloseHandle(text->hReady);
+    text->hThread = text->hFree = text->hReady = NULL;
+
+    for (iSlot = 0; iSlot < TEXT_READ_AHEAD; ++iSlot)
+    {
+        if (text->ahead[iSlot])
+            FreeBlock(text->ahead[iSlot]);
+        text->ahead[iSlot] = NULL;
+    }
+}
+
+// Adds the lines of the next block of the file, which the reader thread has
+// read ahead or which is read now. The last block ends with the EOF line.
+static FCRET ParseNext(FILECOMPARE *pFC, INT iFile)
+{
+    TEXT_FILE *text = &pFC->text[iFile];
+    LINES *lines = &pFC->lines[iFile];
+    TEXT_BLOCK *block;
+    LONGLONG t0;
+    BOOL bOK;
+
+    if (text->bEOF)
+        return FCRET_NO_MORE_DATA;
+
+    if (text->hThread)
+    {
+        WaitForSingleObject(text->hReady, INFINITE);
+        block = text->ahead[text->iAhead];
+        text->ahead[text->iAhead] = NULL;
+        text->iAhead = (text->iAhead + 1) % TEXT_READ_AHEAD;
+        ReleaseSemaphore(text->hFree, 1, NULL);
+    }
+    else
+    {
+        block = ReadBlock(pFC, iFile, FALSE);
+    }
+    if (!block)
+        return OutOfMemory();
+
+    if (text->lastBlock)
+        text->lastBlock->next = block;
+    else
+        text->blocks = block;
+    text->lastBlock = block;
+
+    if (block->dwError == ERROR_READ_FAULT)
+        return CannotRead(pFC->file[iFile]);
+    if (block->dwError)
+        return OutOfMemory();
+    t0 = STATS_START();
+    bOK = AddBlockLines(pFC, iFile, block);
+    STATS_STOP(qpcParse, t0);
+    if (!bOK)
+        return OutOfMemory();
+
+    if (!block->bLast)
+    {
+        block->iEnd = lines->cLines;
+        return FCRET_IDENTICAL;
+    }
+
+    // the last line without '\n' and the EOF line
+    if (text->cchCarry > 0 &&
+        !AddLine(pFC, iFile, &block->arena, text->pCarry,
+                 TrimCR(text->pCarry, text->cchCarry), TRUE, 0))
+    {
+        return OutOfMemory();
+    }
+    text->cchCarry = 0;
+    if (!AddEOFLine(lines))
+        return OutOfMemory();
+    block->iEnd = lines->cLines;
+    text->bEOF = TRUE;
+    return FCRET_NO_MORE_DATA;
+}
+
+// Releases the lines before i, which the comparison has passed, with their
+// chunks and blocks. A class is forgotten when its last lines are released.
+static VOID ReleaseLines(FILECOMPARE *pFC, INT iFile, DWORD i)
+{
+    LINES *lines = &pFC->lines[iFile];
+    TEXT_FILE *text = &pFC->text[iFile];
+    INTERN_CLASS *cls;
+    TEXT_BLOCK *block;
+    DWORD iLine, id;
+
+    if (i <= lines->iFirst)
+        return;
+
+    for (iLine = lines->iFirst; iLine < i; ++iLine)
+    {
+        id = LINE_ID(lines, iLine);
+        if (id == ID_EOF)
+            continue;
+        cls = &pFC->intern.classes[id];
+        if (cls->iLast[iFile] != iLine)
+            continue;
+        cls->iLast[iFile] = NO_LINE;
+        if (cls->iLast[!iFile] == NO_LINE)
+            RemoveClass(&pFC->intern, id);
+    }
+
+    for (iLine = lines->iFirst & ~LINE_CHUNK_MASK; iLine + LINE_CHUNK_SIZE <= i;
+         iLine += LINE_CHUNK_SIZE)
+    {
+        free(LINE_CHUNK(lines, iLine));
+        LINE_CHUNK(lines, iLine) = NULL;
+    }
+    lines->iFirst = i;
+
+    // the last block is kept for ParseNext to link the next one
+    while ((block = text->blocks) != NULL && block->iEnd <= i && block->next)
+    {
+        text->blocks = block->next;
+        FreeBlock(block);
+    }
+}
+
+static VOID FreeText(FILECOMPARE *pFC, INT iFile)
+{
+    LINES *lines = &pFC->lines[iFile];
+    TEXT_FILE *text = &pFC->text[iFile];
+    TEXT_BLOCK *block, *next;
+    DWORD iChunk;
+
+    for (iChunk = 0; iChunk < lines->cChunks; ++iChunk)
+        free(lines->chunks[iChunk]);
+    free(lines->chunks);
+    for (block = text->blocks; block; block = next)
+    {
+        next = block->next;
+        FreeBlock(block);
+    }
+    free(text->pCarry);
+    ZeroMemory(lines, sizeof(*lines));
+    ZeroMemory(text, sizeof(*text));
+}
+
+// Prints line #i with the tabs expanded unless /T. The spaces are printed as
+// they are even if /W. The line is printed as it is if out of memory.
+static VOID ShowLine(FILECOMPARE *pFC, const LINES *lines, DWORD i)
+{
+    DWORD cch;
+    LPCTSTR pch = GetLineText(pFC, 0, pFC->dwFlags & ~FLAG_W,
+                              LINE_PCH(lines, i), LINE_CCH(lines, i), &cch);
+    if (!pch)
+    {
+        pch = LINE_PCH(lines, i);
+        cch = LINE_CCH(lines, i);
+    }
+    PrintLine(pFC, LINENO(i), pch, cch);
+}
+
+static VOID
+ShowDiff(FILECOMPARE *pFC, INT i, DWORD begin, DWORD end)
+{
+    const LINES *lines = &pFC->lines[i];
+    DWORD n = lines->cLines, first = n, last = n;
+    PrintCaption(pFC->file[i]);
+    if (begin < n && end < n && begin > 0)
+        --begin;
+    while (begin != end)
+    {
+        if (IsEOFLine(lines, begin))
+            break;
+        if (first == n)
+            first = begin;
+        last = begin;
+        if (!(pFC->dwFlags & FLAG_A))
+            ShowLine(pFC, lines, begin);
+        ++begin;
+    }
+    if ((pFC->dwFlags & FLAG_A) && first < n)
+    {
+        ShowLine(pFC, lines, first);
+        ++first;
+        if (first != last)
+        {
+            if (first + 1 == last)
+                ShowLine(pFC, lines, first);
+            else
+                PrintDots();
+        }
+        ShowLine(pFC, lines, last);
+    }
+}
+
+static VOID
+SkipIdentical(FILECOMPARE *pFC, DWORD *pi0, DWORD *pi1)
+{
+    DWORD i0 = *pi0, i1 = *pi1;
+    DWORD n0 = pFC->lines[0].cLines, n1 = pFC->lines[1].cLines;
+    while (i0 < n0 && i1 < n1)
+    {
+        if (CompareLine(pFC, i0, i1) != FCRET_IDENTICAL)
+            break;
+        ++i0;
+        ++i1;
+    }
+    STATS_ADD(cLineCompares, i0 - *pi0 + (i0 < n0 && i1 < n1));
+    *pi0 = i0;
+    *pi1 = i1;
+}
+
+static DWORD
+SkipIdenticalN(FILECOMPARE *pFC, DWORD *pi0, DWORD *pi1,
+               DWORD nnnn, DWORD lineno0, DWORD lineno1)
+{
+    DWORD i0 = *pi0, i1 = *pi1;
+    DWORD n0 = pFC->lines[0].cLines, n1 = pFC->lines[1].cLines;
+    DWORD count = 0, cCompares = 0;
+    while (i0 < n0 && i1 < n1)
+    {
+        if (LINENO(i0) >= lineno0)
+            break;
+        if (LINENO(i1) >= lineno1)
+            break;
+        ++cCompares;
+        if (CompareLine(pFC, i0, i1) != FCRET_IDENTICAL)
+            break;
+        ++i0;
+        ++i1;
+        ++count;
+        if (count >= nnnn)
+            break;
+    }
+    STATS_ADD(cLineCompares, cCompares);
+    *pi0 = i0;
+    *pi1 = i1;
+    return count;
+}
+
+static FCRET
+ScanDiff(FILECOMPARE *pFC, DWORD *pi0, DWORD *pi1,
+         DWORD lineno0, DWORD lineno1)
+{
+    DWORD i0 = *pi0, i1 = *pi1, tmp0, tmp1;
+    DWORD n0 = pFC->lines[0].cLines, n1 = pFC->lines[1].cLines;
+    INT count;
+    while (i0 < n0 && i1 < n1)
+    {
+        if (LINENO(i0) >= lineno0)
+            return FCRET_DIFFERENT;
+        if (LINENO(i1) >= lineno1)
+            return FCRET_DIFFERENT;
+        tmp0 = i0;
+        tmp1 = i1;
+        count = SkipIdenticalN(pFC, &tmp0, &tmp1, pFC->nnnn, lineno0, lineno1);
+        if (count >= pFC->nnnn)
+            break;
+        if (count > 0)
+        {
+            i0 = tmp0;
+            i1 = tmp1;
+        }
+        else
+        {
+            ++i0;
+            ++i1;
+        }
+    }
+    *pi0 = i0;
+    *pi1 = i1;
+    return FCRET_IDENTICAL;
+}
+
+// The lines of a resync window indexed by the IDs. The lines of the same ID
+// are chained in the order of the distances from the start of the window.
+typedef struct RESYNC_SLOT
+{
+    DWORD id;
+    INT first, last; // distances, or -1 if the slot is empty
+} RESYNC_SLOT;
+
+typedef struct RESYNC_INDEX
+{
+    RESYNC_SLOT *slots;
+    DWORD cSlots;
+    INT *next; // the next distance of the same ID, or -1
+    INT cLines, cNext;
+} RESYNC_INDEX;
+
+static RESYNC_SLOT *ResyncSlot(RESYNC_SLOT *slots, DWORD cSlots, DWORD id)
+{
+    DWORD iSlot = id & (cSlots - 1);
+    while (slots[iSlot].first != -1 && slots[iSlot].id != id)
+        iSlot = (iSlot + 1) & (cSlots - 1);
+    return &slots[iSlot];
+}
+
+static INT ResyncFirst(const RESYNC_INDEX *index, DWORD id)
+{
+    if (!index->cLines)
+        return -1;
+    return ResyncSlot(index->slots, index->cSlots, id)->first;
+}
+
+// Adds the line at the next distance. The index grows as the search goes
+// farther, so that a near match costs little.
+static BOOL ResyncAdd(RESYNC_INDEX *index, DWORD id)
+{
+    RESYNC_SLOT *slots, *slot;
+    DWORD cSlots, iSlot;
+    INT *next, d = index->cLines;
+
+    if (2 * (DWORD)(d + 1) > index->cSlots)
+    {
+        cSlots = max(64, index->cSlots * 2);
+        slots = malloc(cSlots * sizeof(RESYNC_SLOT));
+        if (!slots)
+            return FALSE;
+        for (iSlot = 0; iSlot < cSlots; ++iSlot)
+            slots[iSlot].first = -1;
+        for (iSlot = 0; iSlot < index->cSlots; ++iSlot)
+        {
+            if (index->slots[iSlot].first != -1)
+                *ResyncSlot(slots, cSlots, index->slots[iSlot].id) = index->slots[iSlot];
+        }
+        free(index->slots);
+        index->slots = slots;
+        index->cSlots = cSlots;
+    }
+    if (d >= index->cNext)
+    {
+        next = realloc(index->next, max(64, index->cNext * 2) * sizeof(INT));
+        if (!next)
+            return FALSE;
+        index->next = next;
+        index->cNext = max(64, index->cNext * 2);
+    }
+
+    slot = ResyncSlot(index->slots, index->cSlots, id);
+    if (slot->first == -1)
+    {
+        slot->id = id;
+        slot->first = d;
+    }
+    else
+    {
+        index->next[slot->last] = d;
+    }
+    slot->last = d;
+    index->next[d] = -1;
+    ++index->cLines;
+    return TRUE;
+}
+
+static FCRET
+Resync(FILECOMPARE *pFC, DWORD *pi0, DWORD *pi1)
+{
+    FCRET ret;
+    const LINES *lines0 = &pFC->lines[0], *lines1 = &pFC->lines[1];
+    DWORD n0 = lines0->cLines, n1 = lines1->cLines;
+    DWORD i0, i1, save0 = n0, save1 = n1, base0 = *pi0 + 1, base1 = *pi1 + 1;
+    DWORD lineno0, lineno1, cCompares = 0;
+    INT d, d0, d1, w0, w1;
+    RESYNC_INDEX index[2];
+
+    lineno0 = LINENO(*pi0) + pFC->n;
+    lineno1 = LINENO(*pi1) + pFC->n;
+
+    // ``If the files that you are comparing have more than pFC->n consecutive
+    //   differing lines, FC cancels the comparison,,
+    // ``If the number of matching lines in the files is less than pFC->nnnn,
+    //   FC displays the matching lines as differences,,
+    // The windows are the lines before lineno0 and lineno1.
+    w0 = (INT)((min(n0, lineno0 - 1) > base0) ? min(n0, lineno0 - 1) - base0 : 0);
+    w1 = (INT)((min(n1, lineno1 - 1) > base1) ? min(n1, lineno1 - 1) - base1 : 0);
+
+    // The penalty of the match of the distances d0 and d1 is
+    // min(d0, d1) + abs(d1 - d0), that is max(d0, d1). The first match of the
+    // least penalty is taken by the smaller d1 and then the smaller d0, so the
+    // matches are searched in the order of the penalty d.
+    STATS_ADD(cResyncs, 1);
+    STATS_MAX(cResyncMaxWindow, max(w0, w1));
+    ZeroMemory(index, sizeof(index));
+    for (d = 0; d < max(w0, w1) && save0 >= n0; ++d)
+    {
+        if (d < w0)
+        {
+            // line d of file #0 against the nearer lines of file #1
+            for (d1 = ResyncFirst(&index[1], LINE_ID(lines0, base0 + d)); d1 != -1;
+                 d1 = index[1].next[d1])
+            {
+                ++cCompares;
+                if (CompareLine(pFC, base0 + d, base1 + d1) == FCRET_IDENTICAL)
+                {
+                    save0 = base0 + d;
+                    save1 = base1 + d1;
+                    break;
+                }
+            }
+            if (save0 < n0)
+                break;
+            if (!ResyncAdd(&index[0], LINE_ID(lines0, base0 + d)))
+                break;
+        }
+        if (d < w1)
+        {
+            // line d of file #1 against the lines of file #0 up to d
+            for (d0 = ResyncFirst(&index[0], LINE_ID(lines1, base1 + d)); d0 != -1;
+                 d0 = index[0].next[d0])
+            {
+                ++cCompares;
+                if (CompareLine(pFC, base0 + d0, base1 + d) == FCRET_IDENTICAL)
+                {
+                    save0 = base0 + d0;
+                    save1 = base1 + d;
+                    break;
+                }
+            }
+            if (save0 < n0)
+                break;
+            if (!ResyncAdd(&index[1], LINE_ID(lines1, base1 + d)))
+                break;
+        }
+    }
+    STATS_ADD(cResyncLines, d);
+    STATS_ADD(cLineCompares, cCompares);
+    free(index[0].slots);
+    free(index[0].next);
+    free(index[1].slots);
+    free(index[1].next);
+    if (d < max(w0, w1) && save0 >= n0)
+        return OutOfMemory();
+
+    if (save0 < n0 && save1 < n1)
+    {
+        *pi0 = save0;
+        *pi1 = save1;
+        ret = ScanDiff(pFC, &save0, &save1, lineno0, lineno1);
+        if (save0 < n0 && save1 < n1)
+        {
+            *pi0 = save0;
+            *pi1 = save1;
+        }
+        return ret;
+    }
+
+    for (i0 = *pi0; i0 < n0; ++i0)
+    {
+        if (LINENO(i0) == lineno0)
+            break;
+    }
+    for (i1 = *pi1; i1 < n1; ++i1)
+    {
+        if (LINENO(i1) == lineno1)
+            break;
+    }
+    *pi0 = i0;
+    *pi1 = i1;
+    return FCRET_DIFFERENT;
+}
+
+// Shows the lines from i to the end of the file as ShowDiff does. They are
+// parsed and released on the way, so that a long tail takes no more memory.
+static FCRET ShowRest(FILECOMPARE *pFC, INT iFile, DWORD i)
+{
+    const LINES *lines = &pFC->lines[iFile];
+    DWORD first = NO_LINE, last = NO_LINE;
+    FCRET ret;
+
+    PrintCaption(pFC->file[iFile]);
+    for (;;)
+    {
+        for (; !IsEOFLine(lines, i); ++i)
+        {
+            if (first == NO_LINE)
             {
-                // resync failed
-                ret = ResyncFailed();
-                // show the difference
-                ShowDiff(pFC, 0, save0, ptr0);
-                ShowDiff(pFC, 1, save1, ptr1);
-                PrintEndOfDiff();
-                goto cleanup;
+                first = i;
+                if (pFC->dwFlags & FLAG_A)
+                    ShowLine(pFC, lines, i);
             }
+            last = i;
+            if (!(pFC->dwFlags & FLAG_A))
+                ShowLine(pFC, lines, i);
+        }
+        if (i < lines->cLines || pFC->text[iFile].bEOF)
+            break;
 
-            // show the difference
+        // /A shows the line before the last one
+        ReleaseLines(pFC, iFile, (i > 2) ? i - 2 : 0);
+        ret = ParseNext(pFC, iFile);
+        if (ret == FCRET_INVALID)
+            return ret;
+    }
+
+    if ((pFC->dwFlags & FLAG_A) && first != NO_LINE)
+    {
+        ++first;
+        if (first != last)
+        {
+            if (first + 1 == last)
+                ShowLine(pFC, lines, first);
+            else
+                PrintDots();
+        }
+        ShowLine(pFC, lines, last);
+    }
+    return FCRET_DIFFERENT;
+}
+
+static FCRET 
+Finalize(FILECOMPARE* pFC, DWORD i0, DWORD i1, BOOL fDifferent)
+{
+    if (i0 >= pFC->lines[0].cLines && i1 >= pFC->lines[1].cLines)
+    {
+        if (fDifferent)
+            return Different(pFC->file[0], pFC->file[1]);
+        return NoDifference();
+    }
+    else
+    {
+        if (ShowRest(pFC, 0, i0) == FCRET_INVALID || ShowRest(pFC, 1, i1) == FCRET_INVALID)
+            return FCRET_INVALID;
+        PrintEndOfDiff();
+        return FCRET_DIFFERENT;
+    }
+}
+
+// Myers' O(ND) algorithm with the linear space refinement (/ALGO:MYERS).
+// It marks the lines that are not in a longest common subsequence.
+typedef struct MYERS
+{
+    FILECOMPARE *pFC;
+    INT *fd, *bd; // furthest reaching x of each diagonal k = x - y
+    INT *prev; // the previous line of the same ID (/ALGO:HISTOGRAM)
+    LPBYTE changed[2];
+    LONGLONG cCompares; // for /STATS
+} MYERS;
+
+#define LINES_EQUAL(m, x, y) \
+    (++(m)->cCompares, CompareLine((m)->pFC, (x), (y)) == FCRET_IDENTICAL)
+
+// Finds a point on the middle snake of [x0, x1) x [y0, y1)
+static VOID
+MiddleSnake(MYERS *m, INT x0, INT x1, INT y0, INT y1, INT *pxMid, INT *pyMid)
+{
+    INT *fd = m->fd, *bd = m->bd;
+    INT dmin = x0 - y1, dmax = x1 - y0;
+    INT fmid = x0 - y0, bmid = x1 - y1;
+    INT fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+    BOOL odd = (fmid - bmid) & 1;
+    INT d, x, y;
+
+    fd[fmid] = x0;
+    bd[bmid] = x1;
+    for (;;)
+    {
+        // forward
+        if (fmin > dmin)
+            fd[--fmin - 1] = -1;
+        else
+            ++fmin;
+        if (fmax < dmax)
+            fd[++fmax + 1] = -1;
+        else
+            --fmax;
+        for (d = fmax; d >= fmin; d -= 2)
+        {
+            x = (fd[d - 1] >= fd[d + 1]) ? fd[d - 1] + 1 : fd[d + 1];
+            for (y = x - d; x < x1 && y < y1 && LINES_EQUAL(m, x, y); ++x, ++y)
+                ;
+            fd[d] = x;
+            if (odd && bmin <= d && d <= bmax && bd[d] <= x)
+            {
+                *pxMid = x;
+                *pyMid = x - d;
+                return;
+            }
+        }
+
+        // backward
+        if (bmin > dmin)
+            bd[--bmin - 1] = MAXLONG;
+        else
+            ++bmin;
+        if (bmax < dmax)
+            bd[++bmax + 1] = MAXLONG;
+        else
+            --bmax;
+        for (d = bmax; d >= bmin; d -= 2)
+        {
+            x = (bd[d - 1] < bd[d + 1]) ? bd[d - 1] : bd[d + 1] - 1;
+            for (y = x - d; x > x0 && y > y0 && LINES_EQUAL(m, x - 1, y - 1); --x, --y)
+                ;
+            bd[d] = x;
+            if (!odd && fmin <= d && d <= fmax && x <= fd[d])
+            {
+                *pxMid = x;
+                *pyMid = x - d;
+                return;
+            }
+        }
+    }
+}
+
+static VOID MyersCompareSeq(MYERS *m, INT x0, INT x1, INT y0, INT y1)
+{
+    INT xMid, yMid;
+
+    // the common prefix and suffix are not a part of the edit script
+    while (x0 < x1 && y0 < y1 && LINES_EQUAL(m, x0, y0))
+    {
+        ++x0;
+        ++y0;
+    }
+    while (x1 > x0 && y1 > y0 && LINES_EQUAL(m, x1 - 1, y1 - 1))
+    {
+        --x1;
+        --y1;
+    }
+
+    if (x0 == x1)
+    {
+        memset(&m->changed[1][y0], TRUE, y1 - y0);
+    }
+    else if (y0 == y1)
+    {
+        memset(&m->changed[0][x0], TRUE, x1 - x0);
+    }
+    else
+    {
+        MiddleSnake(m, x0, x1, y0, y1, &xMid, &yMid);
+        MyersCompareSeq(m, x0, xMid, y0, yMid);
+        MyersCompareSeq(m, xMid, x1, yMid, y1);
+    }
+}
+
+// The patience and histogram algorithms (/ALGO:HISTOGRAM). The lines that
+// occur once in both parts are matched up first, and the parts between them
+// are compared recursively. Where no line is unique, the common run around
+// the rarest line is taken as the anchor. Myers' algorithm takes over where
+// all the common lines are frequent.
+#define MAX_HISTOGRAM_COUNT 64
+
+// The size of the gap after the i-th anchor
+#define GAP_SIZE(ax, ay, i) (((ax)[(i) + 1] - (ax)[i]) + ((ay)[(i) + 1] - (ay)[i]))
+
+typedef struct HISTOGRAM_SLOT
+{
+    DWORD id;
+    INT count0; // zero if the slot is empty
+    INT count1; // counted only for the IDs in the first part
+    INT last0; // the last line of the ID. The earlier ones are chained by prev
+} HISTOGRAM_SLOT;
+
+typedef struct HISTOGRAM
+{
+    HISTOGRAM_SLOT *slots;
+    DWORD mask;
+} HISTOGRAM;
+
+static __inline HISTOGRAM_SLOT *
+HistogramSlot(const HISTOGRAM *h, DWORD id)
+{
+    DWORD iSlot = id & h->mask;
+    while (h->slots[iSlot].count0 && h->slots[iSlot].id != id)
+        iSlot = (iSlot + 1) & h->mask;
+    return &h->slots[iSlot];
+}
+
+static BOOL
+BuildHistogram(MYERS *m, HISTOGRAM *h, INT x0, INT x1, INT y0, INT y1)
+{
+    const LINES *lines0 = &m->pFC->lines[0], *lines1 = &m->pFC->lines[1];
+    HISTOGRAM_SLOT *slot;
+    DWORD cSlots = 16;
+    INT x, y;
+
+    while (cSlots < 2 * (DWORD)(x1 - x0))
+        cSlots *= 2;
+    h->slots = calloc(cSlots, sizeof(HISTOGRAM_SLOT));
+    if (!h->slots)
+        return FALSE;
+    h->mask = cSlots - 1;
+
+    for (x = x0; x < x1; ++x)
+    {
+        slot = HistogramSlot(h, LINE_ID(lines0, x));
+        m->prev[x] = slot->count0 ? slot->last0 : -1;
+        slot->id = LINE_ID(lines0, x);
+        slot->last0 = x;
+        ++slot->count0;
+    }
+    for (y = y0; y < y1; ++y)
+    {
+        slot = HistogramSlot(h, LINE_ID(lines1, y));
+        if (slot->count0)
+            ++slot->count1;
+    }
+    return TRUE;
+}
+
+// Matches up the lines unique to both parts, and keeps the longest run of the
+// matches in the same order (patience sorting). The anchors are returned in
+// ax[1...cAnchors] and ay[1...cAnchors] with the ends of the parts around
+// them as the sentinels. The caller frees ax.
+static BOOL
+FindUniqueAnchors(MYERS *m, const HISTOGRAM *h, INT x0, INT x1, INT y0, INT y1,
+                  INT **pax, INT **pay, INT *pcAnchors)
+{
+    const LINES *lines1 = &m->pFC->lines[1];
+    const HISTOGRAM_SLOT *slot;
+    INT *ax, *ay, *tails, *back, *chain, c = 0, cTails = 0, i, iLow, iHigh, iMid, y;
+    INT n = y1 - y0 + 2;
+
+    *pax = *pay = NULL;
+    *pcAnchors = 0;
+    ax = malloc(5 * n * sizeof(INT));
+    if (!ax)
+        return FALSE;
+    ay = ax + n;
+    tails = ay + n;
+    back = tails + n;
+    chain = back + n;
+
+    for (y = y0; y < y1; ++y)
+    {
+        slot = HistogramSlot(h, LINE_ID(lines1, y));
+        if (slot->count0 != 1 || slot->count1 != 1 || !LINES_EQUAL(m, slot->last0, y))
+            continue;
+
+        // the longest increasing x so far that this match can extend
+        iLow = 0;
+        iHigh = cTails;
+        while (iLow < iHigh)
+        {
+            iMid = iLow + (iHigh - iLow) / 2;
+            if (ax[tails[iMid]] < slot->last0)
+                iLow = iMid + 1;
+            else
+                iHigh = iMid;
+        }
+        ax[c] = slot->last0;
+        ay[c] = y;
+        back[c] = (iLow > 0) ? tails[iLow - 1] : -1;
+        tails[iLow] = c;
+        if (iLow == cTails)
+            ++cTails;
+        ++c;
+    }
+
+    if (cTails == 0)
+    {
+        free(ax);
+        return TRUE;
+    }
+
+    // walk back the chain, and move it to the beginning of the arrays
+    for (i = cTails, c = tails[cTails - 1]; i > 0; --i, c = back[c])
+    {
+        tails[i] = ax[c];
+        chain[i] = ay[c];
+    }
+    tails[0] = x0 - 1;
+    chain[0] = y0 - 1;
+    tails[cTails + 1] = x1;
+    chain[cTails + 1] = y1;
+    memmove(ax, tails, (cTails + 2) * sizeof(INT));
+    memmove(ax + cTails + 2, chain, (cTails + 2) * sizeof(INT));
+    *pax = ax;
+    *pay = ax + cTails + 2;
+    *pcAnchors = cTails;
+    return TRUE;
+}
+
+// Finds the common run [s0, e0) x [s1, e1) around the rarest common line.
+// Returns the number of the occurrences of the rarest line, or MAXLONG if the
+// parts have no line in common.
+static INT
+FindRareAnchor(MYERS *m, const HISTOGRAM *h, INT x0, INT x1, INT y0, INT y1,
+               INT *ps0, INT *ps1, INT *pe0, INT *pe1)
+{
+    const LINES *lines0 = &m->pFC->lines[0], *lines1 = &m->pFC->lines[1];
+    const HISTOGRAM_SLOT *slot;
+    INT x, y, yNext, s0, s1, e0, e1, count, best = MAXLONG;
+
+    for (y = y0; y < y1; y = yNext)
+    {
+        yNext = y + 1;
+        slot = HistogramSlot(h, LINE_ID(lines1, y));
+        if (!slot->count0)
+            continue;
+        if (slot->count0 > MAX_HISTOGRAM_COUNT)
+        {
+            best = min(best, MAX_HISTOGRAM_COUNT + 1); // too frequent
+            continue;
+        }
+        if (slot->count0 > best)
+            continue;
+
+        for (x = slot->last0; x != -1; x = m->prev[x])
+        {
+            if (!LINES_EQUAL(m, x, y))
+                continue;
+
+            // extend the run in both directions
+            count = slot->count0;
+            for (s0 = x, s1 = y; s0 > x0 && s1 > y0 && LINES_EQUAL(m, s0 - 1, s1 - 1); --s0, --s1)
+                count = min(count, HistogramSlot(h, LINE_ID(lines0, s0 - 1))->count0);
+            for (e0 = x + 1, e1 = y + 1; e0 < x1 && e1 < y1 && LINES_EQUAL(m, e0, e1); ++e0, ++e1)
+                count = min(count, HistogramSlot(h, LINE_ID(lines0, e0))->count0);
+
+            // the run is not searched again
+            yNext = max(yNext, e1);
+
+            if (count < best || (count == best && e0 - s0 > *pe0 - *ps0))
+            {
+                *ps0 = s0;
+                *ps1 = s1;
+                *pe0 = e0;
+                *pe1 = e1;
+                best = count;
+            }
+        }
+    }
+    return best;
+}
+
+static BOOL HistogramCompareSeq(MYERS *m, INT x0, INT x1, INT y0, INT y1)
+{
+    HISTOGRAM h;
+    INT *ax, *ay, cAnchors, i, iLargest, s0 = 0, s1 = 0, e0 = 0, e1 = 0, count;
+
+    for (;;)
+    {
+        while (x0 < x1 && y0 < y1 && LINES_EQUAL(m, x0, y0))
+        {
+            ++x0;
+            ++y0;
+        }
+        while (x1 > x0 && y1 > y0 && LINES_EQUAL(m, x1 - 1, y1 - 1))
+        {
+            --x1;
+            --y1;
+        }
+        if (x0 == x1 || y0 == y1)
+            break;
+
+        if (!BuildHistogram(m, &h, x0, x1, y0, y1))
+            return FALSE;
+        if (!FindUniqueAnchors(m, &h, x0, x1, y0, y1, &ax, &ay, &cAnchors))
+        {
+            free(h.slots);
+            return FALSE;
+        }
+
+        if (cAnchors > 0)
+        {
+            free(h.slots);
+
+            // recurse into the gaps between the anchors but the largest one,
+            // and loop for it, so that the stack stays shallow
+            for (i = iLargest = 0; i <= cAnchors; ++i)
+            {
+                if (GAP_SIZE(ax, ay, i) > GAP_SIZE(ax, ay, iLargest))
+                    iLargest = i;
+            }
+            for (i = 0; i <= cAnchors; ++i)
+            {
+                if (i != iLargest &&
+                    !HistogramCompareSeq(m, ax[i] + 1, ax[i + 1], ay[i] + 1, ay[i + 1]))
+                {
+                    free(ax);
+                    return FALSE;
+                }
+            }
+            x0 = ax[iLargest] + 1;
+            x1 = ax[iLargest + 1];
+            y0 = ay[iLargest] + 1;
+            y1 = ay[iLargest + 1];
+            free(ax);
+            continue;
+        }
+
+        count = FindRareAnchor(m, &h, x0, x1, y0, y1, &s0, &s1, &e0, &e1);
+        free(h.slots);
+        if (count == MAXLONG)
+            break; // nothing in common
+        if (count > MAX_HISTOGRAM_COUNT)
+        {
+            MyersCompareSeq(m, x0, x1, y0, y1);
+            return TRUE;
+        }
+
+        // recurse into the smaller part and loop for the other
+        if ((s0 - x0) + (s1 - y0) < (x1 - e0) + (y1 - e1))
+        {
+            if (!HistogramCompareSeq(m, x0, s0, y0, s1))
+                return FALSE;
+            x0 = e0;
+            y0 = e1;
+        }
+        else
+        {
+            if (!HistogramCompareSeq(m, e0, x1, e1, y1))
+                return FALSE;
+            x1 = s0;
+            y1 = s1;
+        }
+    }
+
+    memset(&m->changed[0][x0], TRUE, x1 - x0);
+    memset(&m->changed[1][y0], TRUE, y1 - y0);
+    return TRUE;
+}
+
+// The number of the lines but the EOF line
+static __inline DWORD CountLines(const LINES *lines)
+{
+    return (lines->cLines > 0 && IsEOFLine(lines, lines->cLines - 1)) ?
+           lines->cLines - 1 : lines->cLines;
+}
+
+// Shows the runs of the changed lines in the same format as the FC engine
+static FCRET ReportChanges(FILECOMPARE *pFC, const BYTE *changed0, const BYTE *changed1)
+{
+    DWORD n0 = CountLines(&pFC->lines[0]), n1 = CountLines(&pFC->lines[1]);
+    DWORD i0 = 0, i1 = 0, save0, save1, next0, next1;
+    BOOL fDifferent = FALSE;
+
+    for (;;)
+    {
+        while (i0 < n0 && i1 < n1 && !changed0[i0] && !changed1[i1])
+        {
+            ++i0;
+            ++i1;
+        }
+        if (i0 >= n0 && i1 >= n1)
+            break;
+
+        save0 = i0;
+        save1 = i1;
+        while (i0 < n0 && changed0[i0])
+            ++i0;
+        while (i1 < n1 && changed1[i1])
+            ++i1;
+
+        // i0 and i1 are the lines where both files are in sync again
+        fDifferent = TRUE;
+        next0 = (i0 + 1 < pFC->lines[0].cLines) ? i0 + 1 : i0;
+        next1 = (i1 + 1 < pFC->lines[1].cLines) ? i1 + 1 : i1;
+        ShowDiff(pFC, 0, save0, next0);
+        ShowDiff(pFC, 1, save1, next1);
+        PrintEndOfDiff();
+    }
+
+    return Finalize(pFC, pFC->lines[0].cLines, pFC->lines[1].cLines, fDifferent);
+}
+
+// Compares the whole files by the engine of /ALGO
+static FCRET DiffCompare(FILECOMPARE *pFC)
+{
+    DWORD n0 = CountLines(&pFC->lines[0]), n1 = CountLines(&pFC->lines[1]);
+    DWORD i0 = 0, i1 = 0;
+    MYERS m = { pFC };
+    BOOL bOK = TRUE;
+    FCRET ret;
+
+    if (pFC->dwFlags & FLAG_Q)
+    {
+        // any edit script is not empty
+        SkipIdentical(pFC, &i0, &i1);
+        return (i0 < pFC->lines[0].cLines || i1 < pFC->lines[1].cLines) ?
+               FCRET_DIFFERENT : FCRET_IDENTICAL;
+    }
+
+    // the diagonals range from -n1 - 1 to n0 + 1
+    m.fd = malloc((n0 + n1 + 3) * sizeof(INT));
+    m.bd = malloc((n0 + n1 + 3) * sizeof(INT));
+    m.changed[0] = calloc(n0 + 1, 1);
+    m.changed[1] = calloc(n1 + 1, 1);
+    if (pFC->nAlgo == ALGO_HISTOGRAM)
+        m.prev = malloc((n0 + 1) * sizeof(INT));
+    if (m.fd && m.bd && m.changed[0] && m.changed[1] &&
+        (m.prev || pFC->nAlgo != ALGO_HISTOGRAM))
+    {
+        m.fd += n1 + 1;
+        m.bd += n1 + 1;
+        if (pFC->nAlgo == ALGO_HISTOGRAM)
+            bOK = HistogramCompareSeq(&m, 0, n0, 0, n1);
+        else
+            MyersCompareSeq(&m, 0, n0, 0, n1);
+        m.fd -= n1 + 1;
+        m.bd -= n1 + 1;
+        STATS_ADD(cLineCompares, m.cCompares);
+        ret = bOK ? ReportChanges(pFC, m.changed[0], m.changed[1]) : OutOfMemory();
+    }
+    else
+    {
+        ret = OutOfMemory();
+    }
+
+    free(m.prev);
+    free(m.fd);
+    free(m.bd);
+    free(m.changed[0]);
+    free(m.changed[1]);
+    return ret;
+}
+
+// Parses the next part of file #i
+// Parses ahead so that the resync window from i is there, and releases the
+// lines before i - 1, which ShowDiff may show. The memory stays bounded by the
+// window and the view size however large the file is.
+static FCRET FillWindow(FILECOMPARE *pFC, INT iFile, DWORD i)
+{
+    FCRET ret;
+    ReleaseLines(pFC, iFile, (i > 1) ? i - 1 : 0);
+    while (!pFC->text[iFile].bEOF &&
+           pFC->lines[iFile].cLines <= (ULONGLONG)i + max(pFC->n, 0) + 1)
+    {
+        ret = ParseNext(pFC, iFile);
+        if (ret == FCRET_INVALID)
+            return ret;
+    }
+    return FCRET_IDENTICAL;
+}
+
+static __inline BOOL IsWindowFilled(const FILECOMPARE *pFC, INT iFile, DWORD i)
+{
+    return pFC->text[iFile].bEOF ||
+           pFC->lines[iFile].cLines > (ULONGLONG)i + max(pFC->n, 0) + 1;
+}
+
+FCRET TextCompare(FILECOMPARE *pFC, HANDLE *phMapping0, const LARGE_INTEGER *pcb0,
+                                    HANDLE *phMapping1, const LARGE_INTEGER *pcb1)
+{
+    FCRET ret;
+    DWORD i0 = 0, i1 = 0, save0, save1, next0, next1;
+    LONGLONG t0;
+    BOOL fDifferent = FALSE;
+    LINES *lines0 = &pFC->lines[0], *lines1 = &pFC->lines[1];
+    ZeroMemory(pFC->lines, sizeof(pFC->lines));
+    ZeroMemory(&pFC->intern, sizeof(pFC->intern));
+    ZeroMemory(pFC->text, sizeof(pFC->text));
+    ZeroMemory(pFC->buffer, sizeof(pFC->buffer));
+    pFC->text[0].phMapping = phMapping0;
+    pFC->text[0].pcb = pcb0;
+    pFC->text[1].phMapping = phMapping1;
+    pFC->text[1].pcb = pcb1;
+    pFC->text[0].cbSkip = pFC->cbBOM[0];
+    pFC->text[1].cbSkip = pFC->cbBOM[1];
+
+    // the large files and the streams are read ahead by their own threads
+    if (pFC->stream[0] || pcb0->QuadPart >= TEXT_READER_MIN_SIZE)
+        StartReader(pFC, 0);
+    if (pFC->stream[1] || pcb1->QuadPart >= TEXT_READER_MIN_SIZE)
+        StartReader(pFC, 1);
+
+    if (pFC->nAlgo != ALGO_FC)
+    {
+        // the other engines need the whole files
+        while ((ret = ParseNext(pFC, 0)) == FCRET_IDENTICAL)
+            ;
+        if (ret == FCRET_INVALID)
+            goto cleanup;
+        while ((ret = ParseNext(pFC, 1)) == FCRET_IDENTICAL)
+            ;
+        if (ret == FCRET_INVALID)
+            goto cleanup;
+
+        ret = DiffCompare(pFC);
+        goto cleanup;
+    }
+
+    for (;;)
+    {
+        if (FillWindow(pFC, 0, i0) == FCRET_INVALID || FillWindow(pFC, 1, i1) == FCRET_INVALID)
+        {
+            ret = FCRET_INVALID;
+            goto cleanup;
+        }
+        if (i0 >= lines0->cLines || i1 >= lines1->cLines)
+            goto quit;
+
+        // skip identical (sync'ed)
+        SkipIdentical(pFC, &i0, &i1);
+        if (!IsWindowFilled(pFC, 0, i0) || !IsWindowFilled(pFC, 1, i1))
+            continue; // parse more
+        if (i0 < lines0->cLines || i1 < lines1->cLines)
             fDifferent = TRUE;
-            next0 = ptr0 ? list_next(list0, ptr0) : ptr0;
-            next1 = ptr1 ? list_next(list1, ptr1) : ptr1;
-            ShowDiff(pFC, 0, save0, (next0 ? next0 : ptr0));
-            ShowDiff(pFC, 1, save1, (next1 ? next1 : ptr1));
-            PrintEndOfDiff();
+        if (fDifferent && (pFC->dwFlags & FLAG_Q))
+        {
+            ret = FCRET_DIFFERENT;
+            goto cleanup;
+        }
+        if (IsEOFLine(lines0, i0) || IsEOFLine(lines1, i1))
+            goto quit;
 
-            // now resync'ed
+        // try to resync
+        save0 = i0;
+        save1 = i1;
+        t0 = STATS_START();
+        ret = Resync(pFC, &i0, &i1);
+        STATS_STOP(qpcResync, t0);
+        if (ret == FCRET_INVALID)
+            goto cleanup;
+        if (ret == FCRET_DIFFERENT)
+        {
+            // resync failed
+            ret = ResyncFailed();
+            // show the difference
+            ShowDiff(pFC, 0, save0, i0);
+            ShowDiff(pFC, 1, save1, i1);
+            PrintEndOfDiff();
+            goto cleanup;
         }
-    } while (ret0 != FCRET_NO_MORE_DATA || ret1 != FCRET_NO_MORE_DATA);
+
+        // show the difference
+        fDifferent = TRUE;
+        next0 = (i0 + 1 < lines0->cLines) ? i0 + 1 : i0;
+        next1 = (i1 + 1 < lines1->cLines) ? i1 + 1 : i1;
+        ShowDiff(pFC, 0, save0, next0);
+        ShowDiff(pFC, 1, save1, next1);
+        PrintEndOfDiff();
+
+        // now resync'ed
+    }
 
 quit:
-    ret = Finalize(pFC, ptr0, ptr1, fDifferent);
+    if (pFC->dwFlags & FLAG_Q)
+        ret = ((i0 < lines0->cLines || i1 < lines1->cLines || fDifferent) ?
+               FCRET_DIFFERENT : FCRET_IDENTICAL);
+    else
+        ret = Finalize(pFC, i0, i1, fDifferent);
 cleanup:
-    DeleteList(list0);
-    DeleteList(list1);
+    StopReader(pFC, 0);
+    StopReader(pFC, 1);
+    STATS_ADD(cLines, lines0->cLines + lines1->cLines);
+    STATS_ADD(cbTouched, pFC->text[0].ib + pFC->text[1].ib);
+    // the tables and the views are released at once
+    FreeIntern(&pFC->intern);
+    FreeText(pFC, 0);
+    FreeText(pFC, 1);
+    free(pFC->buffer[0].pch);
+    free(pFC->buffer[1].pch);
     return ret;
 }
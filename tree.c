@@ -0,0 +1,373 @@
+/*
+ * PROJECT:     ReactOS FC Command
+ * LICENSE:     GPL-2.0-or-later (https://spdx.org/licenses/GPL-2.0-or-later)
+ * PURPOSE:     Comparing directory trees
+ * COPYRIGHT:   Copyright 2021 Katayama Hirofumi MZ (katayama.hirofumi.mz@gmail.com)
+ */
+#include "fc.h"
+#include <strsafe.h>
+#include <shlwapi.h>
+
+typedef struct TREE_ENTRY
+{
+    LPWSTR pszPath; // relative to the root
+    INT iMatch; // index of the entry on the other side, or -1
+    FCRET ret; // result of the comparison
+    DEFERRED_OUTPUT output; // the report of the comparison
+} TREE_ENTRY;
+
+typedef struct TREE
+{
+    TREE_ENTRY *entries;
+    INT cEntries, cCapacity;
+} TREE;
+
+typedef struct TREE_POOL
+{
+    const FILECOMPARE *pFC;
+    TREE *trees; // [2]
+    INT *pairs; // indexes into trees[0] of the matched entries
+    INT cPairs;
+    volatile LONG iNextPair;
+} TREE_POOL;
+
+/* Is it L"." or L".."? */
+#define IS_DOTS(pch) \
+    ((*(pch) == L'.') && (((pch)[1] == 0) || (((pch)[1] == L'.') && ((pch)[2] == 0))))
+
+static BOOL AddTreeEntry(TREE *tree, LPCWSTR pszPath)
+{
+    TREE_ENTRY *entries;
+    SIZE_T cch = wcslen(pszPath) + 1;
+
+    if (tree->cEntries >= tree->cCapacity)
+    {
+        tree->cCapacity = max(256, tree->cCapacity * 2);
+        entries = realloc(tree->entries, tree->cCapacity * sizeof(TREE_ENTRY));
+        if (!entries)
+            return FALSE;
+        tree->entries = entries;
+    }
+
+    entries = &tree->entries[tree->cEntries];
+    entries->pszPath = malloc(cch * sizeof(WCHAR));
+    if (!entries->pszPath)
+        return FALSE;
+    StringCchCopyW(entries->pszPath, cch, pszPath);
+    entries->iMatch = -1;
+    entries->ret = FCRET_IDENTICAL;
+    ZeroMemory(&entries->output, sizeof(entries->output));
+    ++tree->cEntries;
+    return TRUE;
+}
+
+static VOID FreeTree(TREE *tree)
+{
+    INT i;
+    for (i = 0; i < tree->cEntries; ++i)
+    {
+        free(tree->entries[i].pszPath);
+        FreeDeferredOutput(&tree->entries[i].output);
+    }
+    free(tree->entries);
+    ZeroMemory(tree, sizeof(*tree));
+}
+
+// Collects the files under root\pszRelDir recursively. The junctions and the
+// symbolic links to directories are skipped, for they may make a cycle.
+static FCRET EnumTree(TREE *tree, LPCWSTR root, LPCWSTR pszRelDir)
+{
+    FCRET ret = FCRET_IDENTICAL;
+    WIN32_FIND_DATAW find;
+    HANDLE hFind;
+    WCHAR szDir[MAX_PATH], szSpec[MAX_PATH], szRelPath[MAX_PATH];
+
+    if (FAILED(StringCbCopyW(szDir, sizeof(szDir), root)) ||
+        (pszRelDir[0] && !PathAppendW(szDir, pszRelDir)) ||
+        FAILED(StringCbCopyW(szSpec, sizeof(szSpec), szDir)) ||
+        !PathAppendW(szSpec, L"*"))
+    {
+        return PathTooLong(szDir);
+    }
+
+    hFind = FindFirstFileW(szSpec, &find);
+    if (hFind == INVALID_HANDLE_VALUE)
+    {
+        // an unreadable directory is not an empty one
+        if (GetLastError() == ERROR_FILE_NOT_FOUND || GetLastError() == ERROR_NO_MORE_FILES)
+            return FCRET_IDENTICAL; // empty
+        CannotOpen(szDir);
+        return FCRET_INVALID;
+    }
+
+    do
+    {
+        if (IS_DOTS(find.cFileName))
+            continue;
+        if ((find.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+            (find.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+        {
+            continue;
+        }
+
+        if (FAILED(StringCbCopyW(szRelPath, sizeof(szRelPath), pszRelDir)) ||
+            !PathAppendW(szRelPath, find.cFileName))
+        {
+            ret = PathTooLong(szDir);
+            break;
+        }
+        if (find.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            ret = EnumTree(tree, root, szRelPath);
+        else if (!AddTreeEntry(tree, szRelPath))
+            ret = OutOfMemory();
+    } while (ret == FCRET_IDENTICAL && FindNextFileW(hFind, &find));
+
+    if (ret == FCRET_IDENTICAL && GetLastError() != ERROR_NO_MORE_FILES)
+    {
+        CannotRead(szDir);
+        ret = FCRET_INVALID;
+    }
+    FindClose(hFind);
+    return ret;
+}
+
+// File names are case-insensitive
+static DWORD HashPath(LPCWSTR psz)
+{
+    DWORD hash = 2166136261u; // FNV-1a
+    for (; *psz; ++psz)
+    {
+        hash ^= towupper(*psz);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Pairs the entries of both trees by the relative paths using a hash table
+static BOOL MatchTrees(TREE *tree0, TREE *tree1)
+{
+    INT *slots, i, j;
+    DWORD cSlots = 16, iSlot;
+
+    while (cSlots < 2 * (DWORD)tree1->cEntries)
+        cSlots *= 2;
+    slots = malloc(cSlots * sizeof(INT));
+    if (!slots)
+        return FALSE;
+    for (iSlot = 0; iSlot < cSlots; ++iSlot)
+        slots[iSlot] = -1;
+
+    for (j = 0; j < tree1->cEntries; ++j)
+    {
+        iSlot = HashPath(tree1->entries[j].pszPath) & (cSlots - 1);
+        while (slots[iSlot] != -1)
+            iSlot = (iSlot + 1) & (cSlots - 1);
+        slots[iSlot] = j;
+    }
+
+    for (i = 0; i < tree0->cEntries; ++i)
+    {
+        iSlot = HashPath(tree0->entries[i].pszPath) & (cSlots - 1);
+        for (; (j = slots[iSlot]) != -1; iSlot = (iSlot + 1) & (cSlots - 1))
+        {
+            if (_wcsicmp(tree0->entries[i].pszPath, tree1->entries[j].pszPath) == 0)
+            {
+                tree0->entries[i].iMatch = j;
+                tree1->entries[j].iMatch = i;
+                break;
+            }
+        }
+    }
+
+    free(slots);
+    return TRUE;
+}
+
+static VOID BuildPaths(const FILECOMPARE *pFC, LPCWSTR pszRelPath,
+                       LPWSTR pszPath0, LPWSTR pszPath1, SIZE_T cchPath)
+{
+    StringCchCopyW(pszPath0, cchPath, pFC->file[0]);
+    PathAppendW(pszPath0, pszRelPath);
+    StringCchCopyW(pszPath1, cchPath, pFC->file[1]);
+    PathAppendW(pszPath1, pszRelPath);
+}
+
+// Workers compare the pairs once each, and keep the reports in the entries.
+// The reports are printed afterwards in order. They never touch the output sink.
+static DWORD WINAPI TreeWorkerThreadProc(LPVOID arg)
+{
+    TREE_POOL *pool = arg;
+    FILECOMPARE fc;
+    WCHAR szPath0[MAX_PATH], szPath1[MAX_PATH];
+    TREE_ENTRY *entry;
+    LONG iPair;
+
+    fc = *pool->pFC;
+    fc.nThreads = 1;
+    fc.file[0] = szPath0;
+    fc.file[1] = szPath1;
+
+    while ((iPair = InterlockedIncrement(&pool->iNextPair) - 1) < pool->cPairs)
+    {
+        entry = &pool->trees[0].entries[pool->pairs[iPair]];
+        BuildPaths(pool->pFC, entry->pszPath, szPath0, szPath1, MAX_PATH);
+        fc.bDigest[0] = fc.bDigest[1] = FALSE;
+        DeferOutput(&entry->output);
+        entry->ret = FileCompare(&fc);
+        DeferOutput(NULL);
+    }
+    return 0;
+}
+
+static FCRET ComparePairs(const FILECOMPARE *pFC, TREE *trees, INT *pairs, INT cPairs)
+{
+    TREE_POOL pool = { .pFC = pFC, .trees = trees, .pairs = pairs, .cPairs = cPairs };
+    HANDLE hThreads[MAX_THREADS];
+    INT cThreads, nThreads = pFC->nThreads;
+    SYSTEM_INFO info;
+
+    // all processors unless /J:n
+    if (nThreads < 1)
+    {
+        GetSystemInfo(&info);
+        nThreads = (INT)min(info.dwNumberOfProcessors, MAX_THREADS);
+    }
+    nThreads = max(1, min(nThreads, cPairs));
+
+    // the current thread is one of them
+    for (cThreads = 0; cThreads < nThreads - 1; ++cThreads)
+    {
+        hThreads[cThreads] = CreateThread(NULL, 0, TreeWorkerThreadProc, &pool, 0, NULL);
+        if (!hThreads[cThreads])
+            break;
+    }
+
+    TreeWorkerThreadProc(&pool);
+
+    if (cThreads > 0)
+        WaitForMultipleObjects(cThreads, hThreads, TRUE, INFINITE);
+    while (cThreads-- > 0)
+        CloseHandle(hThreads[cThreads]);
+    return FCRET_IDENTICAL;
+}
+
+static int __cdecl CompareTreeEntries(const void *p0, const void *p1)
+{
+    const TREE_ENTRY *entry0 = p0, *entry1 = p1;
+    return _wcsicmp(entry0->pszPath, entry1->pszPath);
+}
+
+static int __cdecl CompareTreeEntryPtrs(const void *p0, const void *p1)
+{
+    return CompareTreeEntries(*(const TREE_ENTRY * const *)p0, *(const TREE_ENTRY * const *)p1);
+}
+
+// pFC->file[0] and pFC->file[1] are pszPath0 and pszPath1
+static FCRET ReportTreeEntry(FILECOMPARE *pFC, const FILECOMPARE *pTreeFC, INT iSide,
+                             TREE_ENTRY *entry, LPWSTR pszPath0, LPWSTR pszPath1)
+{
+    BuildPaths(pTreeFC, entry->pszPath, pszPath0, pszPath1, MAX_PATH);
+    if (entry->iMatch == -1)
+    {
+        if (pFC->dwFlags & FLAG_Q)
+            return FCRET_DIFFERENT;
+        return OnlyIn(pFC->file[iSide], pTreeFC->file[iSide]);
+    }
+
+    // the worker has made the report
+    if (PrintDeferredOutput(&entry->output) != FCRET_IDENTICAL)
+        return FCRET_INVALID;
+    return entry->ret;
+}
+
+// Compares two directory trees (/R)
+FCRET TreeFileCompare(FILECOMPARE *pFC)
+{
+    FCRET ret = FCRET_IDENTICAL, retEntry;
+    TREE trees[2];
+    TREE_ENTRY **only1 = NULL, *entry;
+    INT *pairs = NULL, cPairs = 0, cOnly1 = 0, i, j;
+    WCHAR szPath0[MAX_PATH], szPath1[MAX_PATH];
+    FILECOMPARE fc;
+
+    ZeroMemory(trees, sizeof(trees));
+    for (i = 0; i < 2; ++i)
+    {
+        if (!PathIsDirectoryW(pFC->file[i]))
+        {
+            ret = CannotOpen(pFC->file[i]);
+            goto cleanup;
+        }
+        ret = EnumTree(&trees[i], pFC->file[i], L"");
+        if (ret != FCRET_IDENTICAL)
+            goto cleanup;
+    }
+
+    // The left tree gives the order of the report
+    qsort(trees[0].entries, trees[0].cEntries, sizeof(TREE_ENTRY), CompareTreeEntries);
+    if (!MatchTrees(&trees[0], &trees[1]))
+    {
+        ret = OutOfMemory();
+        goto cleanup;
+    }
+
+    pairs = malloc((trees[0].cEntries + 1) * sizeof(INT));
+    only1 = malloc((trees[1].cEntries + 1) * sizeof(TREE_ENTRY *));
+    if (!pairs || !only1)
+    {
+        ret = OutOfMemory();
+        goto cleanup;
+    }
+    for (i = 0; i < trees[0].cEntries; ++i)
+    {
+        if (trees[0].entries[i].iMatch != -1)
+            pairs[cPairs++] = i;
+    }
+    for (j = 0; j < trees[1].cEntries; ++j)
+    {
+        if (trees[1].entries[j].iMatch == -1)
+            only1[cOnly1++] = &trees[1].entries[j];
+    }
+    qsort(only1, cOnly1, sizeof(TREE_ENTRY *), CompareTreeEntryPtrs);
+
+    ComparePairs(pFC, trees, pairs, cPairs);
+
+    // report in the sorted order of the relative paths
+    fc = *pFC;
+    fc.file[0] = szPath0;
+    fc.file[1] = szPath1;
+    for (i = j = 0; i < trees[0].cEntries || j < cOnly1; )
+    {
+        if (j < cOnly1 &&
+            (i >= trees[0].cEntries || CompareTreeEntries(only1[j], &trees[0].entries[i]) < 0))
+        {
+            entry = only1[j++];
+            retEntry = ReportTreeEntry(&fc, pFC, 1, entry, szPath0, szPath1);
+        }
+        else
+        {
+            entry = &trees[0].entries[i++];
+            retEntry = ReportTreeEntry(&fc, pFC, 0, entry, szPath0, szPath1);
+        }
+
+        switch (retEntry)
+        {
+            case FCRET_IDENTICAL:
+                break;
+            case FCRET_DIFFERENT:
+                if (ret != FCRET_INVALID)
+                    ret = FCRET_DIFFERENT;
+                break;
+            default:
+                ret = FCRET_INVALID;
+                break;
+        }
+    }
+
+cleanup:
+    free(pairs);
+    free(only1);
+    FreeTree(&trees[0]);
+    FreeTree(&trees[1]);
+    return ret;
+}